@@ -0,0 +1,162 @@
+#pragma once
+
+#include "stopwatch.h"
+
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <latch>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// One measured run. parameters identifies the configuration, such as
+// "threads=4;reads=90%;keys=zipfian", and together with name is the key
+// results are matched on when comparing against a baseline.
+struct benchmark_result
+{
+	std::string name;
+	std::string parameters;
+	uint64_t operations = 0;
+	int64_t elapsed_nanoseconds = 0;
+	// Workload-specific figures, such as steals or lock contention.
+	std::vector<std::pair<std::string, double>> counters;
+
+	double operations_per_second() const
+	{
+		return elapsed_nanoseconds > 0 ? operations * 1e9 / elapsed_nanoseconds : 0.0;
+	}
+
+	std::string key() const
+	{
+		return name + "|" + parameters;
+	}
+};
+
+// Starts threads workers, releases them together and times from the release
+// until the last one finishes. body(thread_index) runs on each worker.
+template<typename Body>
+int64_t run_timed(size_t threads, Body body)
+{
+	std::latch ready(threads);
+	std::latch start(1);
+	std::vector<std::jthread> workers;
+	workers.reserve(threads);
+
+	for (size_t i = 0; i < threads; ++i)
+	{
+		workers.emplace_back([&, i] {
+			ready.count_down();
+			start.wait();
+			body(i);
+		});
+	}
+
+	ready.wait();
+	stopwatch sw;
+	sw.start();
+	start.count_down();
+	workers.clear();
+	sw.stop();
+
+	return sw.elapsed_nanoseconds();
+}
+
+inline void write_csv(std::ostream& out, const std::vector<benchmark_result>& results)
+{
+	out << "name,parameters,operations,elapsed_ns,ops_per_sec,counters\n";
+	for (const auto& result : results)
+	{
+		out << result.name << ',' << result.parameters << ',' << result.operations << ','
+			<< result.elapsed_nanoseconds << ',' << std::fixed << std::setprecision(0) << result.operations_per_second() << ',';
+
+		for (size_t i = 0; i < result.counters.size(); ++i) {
+			out << (i ? ";" : "") << result.counters[i].first << '=' << std::setprecision(2) << result.counters[i].second;
+		}
+		out << '\n';
+	}
+}
+
+inline void write_json(std::ostream& out, const std::vector<benchmark_result>& results)
+{
+	out << "[\n";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const auto& result = results[i];
+		out << "  {\"name\": \"" << result.name << "\", \"parameters\": \"" << result.parameters
+			<< "\", \"operations\": " << result.operations
+			<< ", \"elapsed_ns\": " << result.elapsed_nanoseconds
+			<< ", \"ops_per_sec\": " << std::fixed << std::setprecision(0) << result.operations_per_second()
+			<< ", \"counters\": {";
+
+		for (size_t j = 0; j < result.counters.size(); ++j) {
+			out << (j ? ", " : "") << '"' << result.counters[j].first << "\": " << std::setprecision(2) << result.counters[j].second;
+		}
+		out << "}}" << (i + 1 < results.size() ? "," : "") << '\n';
+	}
+	out << "]\n";
+}
+
+// Reads ops_per_sec by result key from a file written by write_csv.
+inline std::map<std::string, double> read_baseline(const std::string& path)
+{
+	std::ifstream in(path);
+	if (!in) {
+		throw std::runtime_error("cannot open baseline " + path);
+	}
+
+	std::map<std::string, double> baseline;
+	std::string line;
+	std::getline(in, line);
+
+	while (std::getline(in, line))
+	{
+		std::vector<std::string> fields;
+		std::istringstream row(line);
+		for (std::string field; std::getline(row, field, ',');) {
+			fields.push_back(field);
+		}
+
+		if (fields.size() >= 5) {
+			baseline[fields[0] + "|" + fields[1]] = std::stod(fields[4]);
+		}
+	}
+
+	return baseline;
+}
+
+// Prints each result's throughput change against the baseline and returns
+// false if any result got slower by more than tolerance_percent.
+inline bool compare_with_baseline(
+	std::ostream& out,
+	const std::vector<benchmark_result>& results,
+	const std::map<std::string, double>& baseline,
+	double tolerance_percent)
+{
+	bool within_tolerance = true;
+
+	for (const auto& result : results)
+	{
+		const auto it = baseline.find(result.key());
+		if (it == baseline.end() || it->second <= 0.0)
+		{
+			out << result.name << " [" << result.parameters << "]: no baseline\n";
+			continue;
+		}
+
+		const double change = (result.operations_per_second() / it->second - 1.0) * 100.0;
+		const bool regressed = change < -tolerance_percent;
+		within_tolerance = within_tolerance && !regressed;
+
+		out << result.name << " [" << result.parameters << "]: "
+			<< std::showpos << std::fixed << std::setprecision(1) << change << std::noshowpos << '%'
+			<< (regressed ? "  REGRESSION" : "") << '\n';
+	}
+
+	return within_tolerance;
+}
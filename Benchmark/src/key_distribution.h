@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+// Draws keys in [0, key_count). Uniform spreads accesses evenly; zipfian
+// follows the YCSB generator (Gray et al., "Quickly generating billion-record
+// synthetic databases"), where a few keys take most of the accesses. Zipfian
+// ranks are scrambled so the hot keys are not also adjacent in key order.
+class key_distribution
+{
+public:
+	enum class kind { uniform, zipfian };
+
+	key_distribution(kind kind, uint64_t key_count, double theta = 0.99)
+		: _kind(kind)
+		, _key_count(key_count)
+		, _theta(theta)
+	{
+		if (key_count == 0) {
+			throw std::invalid_argument("key_count is zero");
+		}
+
+		if (_kind == kind::zipfian)
+		{
+			if (theta <= 0.0 || theta >= 1.0) {
+				throw std::invalid_argument("theta must be in (0, 1)");
+			}
+
+			_zeta_n = zeta(key_count, theta);
+			_alpha = 1.0 / (1.0 - theta);
+			_eta = (1.0 - std::pow(2.0 / key_count, 1.0 - theta)) / (1.0 - zeta(2, theta) / _zeta_n);
+		}
+	}
+
+	template<typename Generator>
+	uint64_t next(Generator& generator) const
+	{
+		if (_kind == kind::uniform) {
+			return std::uniform_int_distribution<uint64_t>(0, _key_count - 1)(generator);
+		}
+
+		const double u = std::uniform_real_distribution<double>(0.0, 1.0)(generator);
+		const double uz = u * _zeta_n;
+
+		uint64_t rank;
+		if (uz < 1.0) {
+			rank = 0;
+		}
+		else if (uz < 1.0 + std::pow(0.5, _theta)) {
+			rank = 1;
+		}
+		else {
+			rank = static_cast<uint64_t>(_key_count * std::pow(_eta * u - _eta + 1.0, _alpha));
+		}
+
+		return scramble(rank < _key_count ? rank : _key_count - 1) % _key_count;
+	}
+
+	std::string name() const
+	{
+		return _kind == kind::uniform ? "uniform" : "zipfian";
+	}
+
+private:
+	static double zeta(uint64_t n, double theta)
+	{
+		double sum = 0.0;
+		for (uint64_t i = 1; i <= n; ++i) {
+			sum += 1.0 / std::pow(static_cast<double>(i), theta);
+		}
+		return sum;
+	}
+
+	// FNV-1a over the rank's bytes.
+	static uint64_t scramble(uint64_t rank)
+	{
+		uint64_t hash = 0xcbf29ce484222325ULL;
+		for (int i = 0; i < 8; ++i)
+		{
+			hash ^= (rank >> (i * 8)) & 0xff;
+			hash *= 0x100000001b3ULL;
+		}
+		return hash;
+	}
+
+	const kind _kind;
+	const uint64_t _key_count;
+	const double _theta;
+	double _zeta_n = 0.0;
+	double _alpha = 0.0;
+	double _eta = 0.0;
+};
@@ -0,0 +1,559 @@
+#include "benchmark.h"
+#include "key_distribution.h"
+
+#include "blocking_queue.h"
+#include "concurrent_disjoint_set.h"
+#include "concurrent_priority_queue.h"
+#include "concurrent_skiplist.h"
+#include "disjoint_set.h"
+#include "sharded_map.h"
+#include "stopwatch.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace
+{
+struct benchmark_options
+{
+	std::vector<size_t> threads;
+	std::string filter;
+	std::string format = "csv";
+	std::string output;
+	std::string baseline;
+	double tolerance_percent = 5.0;
+	uint64_t seed = 1;
+	size_t repetitions = 3;
+	uint64_t key_count = 1 << 18;
+	uint64_t operations_per_thread = 1 << 17;
+
+	bool selected(const std::string& name) const
+	{
+		return filter.empty() || name.find(filter) != std::string::npos;
+	}
+};
+
+void print_usage()
+{
+	std::cerr <<
+		"usage: Benchmark [options]\n"
+		"  --threads 1,2,4      thread counts to run (default 1, 2, 4 and all cores)\n"
+		"  --filter text        only run benchmarks whose name contains text\n"
+		"  --format csv|json    output format (default csv)\n"
+		"  --output path        write results to path instead of stdout\n"
+		"  --baseline path      compare against a csv written by an earlier run\n"
+		"  --tolerance percent  slowdown allowed before a result counts as a regression (default 5)\n"
+		"  --repetitions n      runs per configuration; the median is reported (default 3)\n"
+		"  --seed n             random seed (default 1)\n"
+		"  --quick              small sizes and one repetition, for smoke testing\n";
+}
+
+benchmark_options parse_options(int argc, char** argv)
+{
+	benchmark_options options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		const auto value = [&]() -> std::string {
+			if (i + 1 >= argc) {
+				throw std::invalid_argument(arg + " needs a value");
+			}
+			return argv[++i];
+		};
+
+		if (arg == "--threads")
+		{
+			std::istringstream list(value());
+			for (std::string item; std::getline(list, item, ',');) {
+				options.threads.push_back(std::stoul(item));
+			}
+		}
+		else if (arg == "--filter") {
+			options.filter = value();
+		}
+		else if (arg == "--format") {
+			options.format = value();
+		}
+		else if (arg == "--output") {
+			options.output = value();
+		}
+		else if (arg == "--baseline") {
+			options.baseline = value();
+		}
+		else if (arg == "--tolerance") {
+			options.tolerance_percent = std::stod(value());
+		}
+		else if (arg == "--repetitions") {
+			options.repetitions = std::max<size_t>(1, std::stoul(value()));
+		}
+		else if (arg == "--seed") {
+			options.seed = std::stoull(value());
+		}
+		else if (arg == "--quick")
+		{
+			options.repetitions = 1;
+			options.key_count = 1 << 12;
+			options.operations_per_thread = 1 << 12;
+		}
+		else {
+			throw std::invalid_argument("unknown option " + arg);
+		}
+	}
+
+	if (options.format != "csv" && options.format != "json") {
+		throw std::invalid_argument("format must be csv or json");
+	}
+
+	if (options.threads.empty())
+	{
+		const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+		for (size_t threads : { size_t(1), size_t(2), size_t(4), cores })
+		{
+			if (threads <= cores && std::find(options.threads.begin(), options.threads.end(), threads) == options.threads.end()) {
+				options.threads.push_back(threads);
+			}
+		}
+	}
+
+	return options;
+}
+
+// Runs measure() repetitions times and keeps the run with the median
+// throughput, which is steadier than the mean against one-off stalls.
+template<typename Measure>
+benchmark_result median_of(const benchmark_options& options, Measure measure)
+{
+	std::vector<benchmark_result> runs;
+	for (size_t i = 0; i < options.repetitions; ++i) {
+		runs.push_back(measure());
+	}
+
+	std::sort(runs.begin(), runs.end(), [](const auto& a, const auto& b) {
+		return a.operations_per_second() < b.operations_per_second();
+	});
+	return runs[runs.size() / 2];
+}
+
+std::string percent(double ratio)
+{
+	return std::to_string(static_cast<int>(ratio * 100 + 0.5)) + "%";
+}
+
+struct map_workload
+{
+	size_t threads;
+	double read_ratio;
+	key_distribution::kind keys;
+	size_t value_size;
+};
+
+// Every key starts present; reads look keys up and writes alternate
+// between updating a key and removing it, so the map settles at a mix of
+// hits and misses.
+template<typename Map>
+benchmark_result run_map_workload(const std::string& name, const benchmark_options& options, const map_workload& workload)
+{
+	const key_distribution keys(workload.keys, options.key_count);
+	const std::string value(workload.value_size, 'v');
+
+	return median_of(options, [&] {
+		Map map;
+		if constexpr (requires { map.bulk_build(nullptr, nullptr); })
+		{
+			std::vector<std::pair<uint64_t, std::string>> entries;
+			entries.reserve(options.key_count);
+			for (uint64_t key = 0; key < options.key_count; ++key) {
+				entries.emplace_back(key, value);
+			}
+			map.bulk_build(entries.begin(), entries.end());
+		}
+		else
+		{
+			for (uint64_t key = 0; key < options.key_count; ++key) {
+				map.add_or_update(key, value);
+			}
+		}
+
+		benchmark_result result;
+		result.name = name;
+		result.parameters = "threads=" + std::to_string(workload.threads)
+			+ ";reads=" + percent(workload.read_ratio)
+			+ ";keys=" + keys.name()
+			+ ";value=" + std::to_string(workload.value_size);
+		result.operations = workload.threads * options.operations_per_thread;
+
+		result.elapsed_nanoseconds = run_timed(workload.threads, [&](size_t thread_index) {
+			std::mt19937_64 generator(options.seed + thread_index);
+			std::uniform_real_distribution<double> operation(0.0, 1.0);
+			std::string out_value;
+			bool remove = false;
+
+			for (uint64_t i = 0; i < options.operations_per_thread; ++i)
+			{
+				const auto key = keys.next(generator);
+				if (operation(generator) < workload.read_ratio) {
+					map.try_get_value(key, &out_value);
+				}
+				else if ((remove = !remove)) {
+					map.try_remove(key);
+				}
+				else {
+					map.add_or_update(key, value);
+				}
+			}
+		});
+
+		if constexpr (requires { map.contention_count(); }) {
+			result.counters.emplace_back("contention", static_cast<double>(map.contention_count()));
+		}
+		return result;
+	});
+}
+
+void run_map_benchmarks(const benchmark_options& options, std::vector<benchmark_result>* results)
+{
+	using skiplist = concurrent_skiplist<uint64_t, std::string>;
+	using sharded = sharded_map<uint64_t, std::string>;
+
+	for (double read_ratio : { 1.0, 0.9, 0.5, 0.0 })
+	for (auto keys : { key_distribution::kind::uniform, key_distribution::kind::zipfian })
+	for (size_t value_size : { 8, 256 })
+	for (size_t threads : options.threads)
+	{
+		const map_workload workload{ threads, read_ratio, keys, value_size };
+
+		if (options.selected("concurrent_skiplist")) {
+			results->push_back(run_map_workload<skiplist>("concurrent_skiplist", options, workload));
+		}
+
+		if (options.selected("sharded_map")) {
+			results->push_back(run_map_workload<sharded>("sharded_map", options, workload));
+		}
+	}
+}
+
+// Each thread alternates a push with a random priority and a pop, starting
+// from a queue of key_count entries.
+void run_priority_queue_benchmarks(const benchmark_options& options, std::vector<benchmark_result>* results)
+{
+	for (bool relaxed : { false, true })
+	for (size_t threads : options.threads)
+	{
+		const std::string name = relaxed ? "concurrent_priority_queue/relaxed" : "concurrent_priority_queue/exact";
+		if (!options.selected(name)) {
+			continue;
+		}
+
+		results->push_back(median_of(options, [&] {
+			concurrent_priority_queue<uint64_t, uint64_t> queue(threads);
+			std::mt19937_64 fill(options.seed);
+			for (uint64_t i = 0; i < options.key_count; ++i) {
+				queue.push(fill(), i);
+			}
+
+			benchmark_result result;
+			result.name = name;
+			result.parameters = "threads=" + std::to_string(threads);
+			result.operations = threads * options.operations_per_thread;
+
+			result.elapsed_nanoseconds = run_timed(threads, [&](size_t thread_index) {
+				std::mt19937_64 generator(options.seed + thread_index);
+				uint64_t priority;
+				uint64_t value;
+				for (uint64_t i = 0; i < options.operations_per_thread; i += 2)
+				{
+					queue.push(generator(), i);
+					if (relaxed) {
+						queue.try_pop_relaxed(&priority, &value);
+					}
+					else {
+						queue.try_pop_min(&priority, &value);
+					}
+				}
+			});
+
+			return result;
+		}));
+	}
+}
+
+// With one thread each operation pushes then pops; with more, half the
+// threads produce and the rest consume.
+void run_queue_benchmarks(const benchmark_options& options, std::vector<benchmark_result>* results)
+{
+	if (!options.selected("blocking_queue")) {
+		return;
+	}
+
+	for (size_t value_size : { 8, 256 })
+	for (size_t threads : options.threads)
+	{
+		const std::string value(value_size, 'v');
+
+		results->push_back(median_of(options, [&] {
+			blocking_queue<std::string> queue;
+			const size_t producers = threads == 1 ? 1 : threads / 2;
+			const size_t consumers = threads - producers;
+			const uint64_t items = producers * options.operations_per_thread;
+
+			benchmark_result result;
+			result.name = "blocking_queue";
+			result.parameters = "threads=" + std::to_string(threads) + ";value=" + std::to_string(value_size);
+			result.operations = items;
+
+			result.elapsed_nanoseconds = run_timed(threads, [&](size_t thread_index) {
+				std::string out_value;
+				if (consumers == 0)
+				{
+					for (uint64_t i = 0; i < options.operations_per_thread; ++i)
+					{
+						queue.push(value);
+						queue.try_pop(&out_value);
+					}
+				}
+				else if (thread_index < producers)
+				{
+					for (uint64_t i = 0; i < options.operations_per_thread; ++i) {
+						queue.push(value);
+					}
+				}
+				else
+				{
+					const size_t consumer = thread_index - producers;
+					const uint64_t share = items / consumers + (consumer < items % consumers ? 1 : 0);
+					for (uint64_t i = 0; i < share; ++i) {
+						queue.wait_pop(&out_value);
+					}
+				}
+			});
+
+			return result;
+		}));
+	}
+}
+
+// Waits for a task submitted from a worker by running other tasks, so
+// workers never block on each other.
+template<typename Future>
+void help_until_ready(thread_pool& pool, Future& future)
+{
+	while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+		pool.run_pending_task();
+	}
+}
+
+uint64_t fork_join(thread_pool& pool, uint64_t begin, uint64_t end)
+{
+	constexpr uint64_t grain = 64;
+	if (end - begin <= grain) {
+		return 1;
+	}
+
+	const uint64_t middle = begin + (end - begin) / 2;
+	auto left = pool.submit([&pool, begin, middle] { return fork_join(pool, begin, middle); });
+	const uint64_t right = fork_join(pool, middle, end);
+	help_until_ready(pool, left);
+	return left.get() + right;
+}
+
+void run_thread_pool_benchmarks(const benchmark_options& options, std::vector<benchmark_result>* results)
+{
+	for (size_t threads : options.threads)
+	{
+		const std::string parameters = "threads=" + std::to_string(threads);
+
+		if (options.selected("thread_pool/submit"))
+		{
+			results->push_back(median_of(options, [&] {
+				thread_pool pool(threads);
+				const uint64_t tasks = options.operations_per_thread;
+				std::vector<std::future<void>> futures;
+				futures.reserve(tasks);
+
+				stopwatch sw;
+				sw.start();
+				for (uint64_t i = 0; i < tasks; ++i) {
+					futures.push_back(pool.submit([] {}));
+				}
+				for (auto& future : futures) {
+					future.wait();
+				}
+				sw.stop();
+
+				benchmark_result result;
+				result.name = "thread_pool/submit";
+				result.parameters = parameters;
+				result.operations = tasks;
+				result.elapsed_nanoseconds = sw.elapsed_nanoseconds();
+				result.counters.emplace_back("steals", static_cast<double>(pool.steal_count()));
+				return result;
+			}));
+		}
+
+		if (options.selected("thread_pool/fork_join"))
+		{
+			results->push_back(median_of(options, [&] {
+				thread_pool pool(threads);
+				const uint64_t range = options.operations_per_thread * 64;
+
+				stopwatch sw;
+				sw.start();
+				auto root = pool.submit([&pool, range] { return fork_join(pool, 0, range); });
+				const uint64_t leaves = root.get();
+				sw.stop();
+
+				// A binary split has one inner task per leaf, less one.
+				const uint64_t tasks = 2 * leaves - 1;
+				benchmark_result result;
+				result.name = "thread_pool/fork_join";
+				result.parameters = parameters;
+				result.operations = tasks;
+				result.elapsed_nanoseconds = sw.elapsed_nanoseconds();
+				result.counters.emplace_back("steals", static_cast<double>(pool.steal_count()));
+				// As a percentage, since the counters print with two decimals.
+				result.counters.emplace_back("steal_pct", 100.0 * static_cast<double>(pool.steal_count()) / tasks);
+				return result;
+			}));
+		}
+	}
+}
+
+// Random unions followed by the same number of finds; half the finds use
+// the batched, prefetching overload.
+void run_disjoint_set_benchmarks(const benchmark_options& options, std::vector<benchmark_result>* results)
+{
+	constexpr size_t elements = 1 << 20;
+
+	for (auto kind : { key_distribution::kind::uniform, key_distribution::kind::zipfian })
+	{
+		const key_distribution keys(kind, elements);
+
+		if (options.selected("disjoint_set/connect_find"))
+		{
+			results->push_back(median_of(options, [&] {
+				auto set = std::make_unique<disjoint_set<elements, uint32_t>>();
+				std::mt19937_64 generator(options.seed);
+				const uint64_t operations = options.operations_per_thread;
+
+				std::vector<uint32_t> batch(operations / 2);
+				std::vector<uint32_t> roots(batch.size());
+				for (auto& element : batch) {
+					element = static_cast<uint32_t>(keys.next(generator));
+				}
+
+				stopwatch sw;
+				sw.start();
+				for (uint64_t i = 0; i < operations; ++i) {
+					set->connect(static_cast<uint32_t>(keys.next(generator)), static_cast<uint32_t>(keys.next(generator)));
+				}
+				for (uint64_t i = 0; i < operations / 2; ++i) {
+					set->find(static_cast<uint32_t>(keys.next(generator)));
+				}
+				set->find(batch.data(), batch.size(), roots.data());
+				sw.stop();
+
+				benchmark_result result;
+				result.name = "disjoint_set/connect_find";
+				result.parameters = "threads=1;keys=" + keys.name();
+				result.operations = 2 * operations;
+				result.elapsed_nanoseconds = sw.elapsed_nanoseconds();
+				result.counters.emplace_back("components", static_cast<double>(set->component_count()));
+				return result;
+			}));
+		}
+
+		if (options.selected("concurrent_disjoint_set/connect_find"))
+		{
+			for (size_t threads : options.threads)
+			{
+				results->push_back(median_of(options, [&] {
+					concurrent_disjoint_set set(elements);
+
+					benchmark_result result;
+					result.name = "concurrent_disjoint_set/connect_find";
+					result.parameters = "threads=" + std::to_string(threads) + ";keys=" + keys.name();
+					result.operations = threads * options.operations_per_thread;
+
+					result.elapsed_nanoseconds = run_timed(threads, [&](size_t thread_index) {
+						std::mt19937_64 generator(options.seed + thread_index);
+						for (uint64_t i = 0; i < options.operations_per_thread; ++i)
+						{
+							const auto a = keys.next(generator);
+							const auto b = keys.next(generator);
+							if (i % 2) {
+								set.connect(a, b);
+							}
+							else {
+								set.is_connected(a, b);
+							}
+						}
+					});
+
+					return result;
+				}));
+			}
+		}
+	}
+}
+}
+
+int main(int argc, char** argv)
+{
+	benchmark_options options;
+	try {
+		options = parse_options(argc, argv);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << '\n';
+		print_usage();
+		return 2;
+	}
+
+	std::vector<benchmark_result> results;
+	run_map_benchmarks(options, &results);
+	run_priority_queue_benchmarks(options, &results);
+	run_queue_benchmarks(options, &results);
+	run_thread_pool_benchmarks(options, &results);
+	run_disjoint_set_benchmarks(options, &results);
+
+	std::ofstream file;
+	if (!options.output.empty())
+	{
+		file.open(options.output);
+		if (!file)
+		{
+			std::cerr << "cannot open " << options.output << '\n';
+			return 2;
+		}
+	}
+
+	std::ostream& out = options.output.empty() ? std::cout : file;
+	if (options.format == "json") {
+		write_json(out, results);
+	}
+	else {
+		write_csv(out, results);
+	}
+
+	if (!options.baseline.empty())
+	{
+		const bool ok = compare_with_baseline(std::cerr, results, read_baseline(options.baseline), options.tolerance_percent);
+		return ok ? 0 : 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include "concurrent_skiplist.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+
+// A bounded cache over concurrent_skiplist. Entries may carry a time to
+// live; an expired entry disappears from lookups at once and is removed by
+// the sweeper, by eviction or by the next write of its key. When an insert
+// takes the cache over capacity, entries are evicted by the CLOCK
+// approximation of LRU, driven by the reference bit each lookup sets.
+//
+// Lookups take no lock besides the entry's value lock and only ever write
+// the reference bit, and only when it is clear. Removed nodes are freed
+// through epoch_reclaimer, so memory stays bounded as entries churn.
+template <typename Key, typename Value>
+class concurrent_cache
+{
+	using list_type = concurrent_skiplist<Key, Value>;
+
+	// Shared with the sweeper task, which may still run after the cache is
+	// gone; the destructor clears owner under the mutex.
+	struct sweeper_state
+	{
+		std::mutex mutex;
+		concurrent_cache* owner;
+		size_t budget;
+	};
+
+public:
+	using clock = typename list_type::clock;
+
+	// default_ttl applies to entries put without a ttl; zero means they do
+	// not expire.
+	explicit concurrent_cache(size_t capacity, typename clock::duration default_ttl = clock::duration::zero())
+		: _capacity(capacity)
+		, _default_ttl(default_ttl)
+	{
+		if (capacity == 0) {
+			throw std::invalid_argument("capacity must be positive");
+		}
+		if (default_ttl < clock::duration::zero()) {
+			throw std::invalid_argument("default_ttl is negative");
+		}
+	}
+
+	concurrent_cache(const concurrent_cache&) = delete;
+	concurrent_cache& operator=(const concurrent_cache&) = delete;
+
+	~concurrent_cache()
+	{
+		stop_sweeper();
+	}
+
+	bool try_get_value(const Key& key, Value* out_value) const
+	{
+		return _list.try_get_value(key, out_value);
+	}
+
+	void put(const Key& key, Value value)
+	{
+		const bool added = _default_ttl > clock::duration::zero()
+			? _list.add_or_update(key, std::move(value), _default_ttl)
+			: _list.add_or_update(key, std::move(value));
+
+		if (added) {
+			make_room();
+		}
+	}
+
+	void put(const Key& key, Value value, typename clock::duration ttl)
+	{
+		if (_list.add_or_update(key, std::move(value), ttl)) {
+			make_room();
+		}
+	}
+
+	bool try_remove(const Key& key)
+	{
+		return _list.try_remove(key);
+	}
+
+	// Entries held, counting expired ones not yet removed. Stays within
+	// capacity plus EVICTION_SLACK and the inserts in flight.
+	size_t size() const
+	{
+		return _list.size();
+	}
+
+	size_t capacity() const
+	{
+		return _capacity;
+	}
+
+	// Live entries the clock hand removed to make room. Expired entries it
+	// passes count towards expired_count instead.
+	uint64_t eviction_count() const
+	{
+		return _evictions.load(std::memory_order_relaxed);
+	}
+
+	uint64_t expired_count() const
+	{
+		return _expirations.load(std::memory_order_relaxed);
+	}
+
+	// Removes expired entries among the next budget entries, carrying on
+	// from where the previous call stopped. Returns the number removed.
+	size_t sweep(size_t budget)
+	{
+		std::scoped_lock<std::mutex> lock(_sweep_mutex);
+		const size_t removed = _list.remove_expired(&_sweep_cursor, budget);
+		_expirations.fetch_add(removed, std::memory_order_relaxed);
+		return removed;
+	}
+
+	// Runs sweep(entries_per_run) on pool every interval until stop_sweeper
+	// or destruction. Each run is one short task, so the sweeper never ties
+	// up a worker.
+	void start_sweeper(thread_pool& pool, typename clock::duration interval, size_t entries_per_run = DEFAULT_SWEEP_BUDGET)
+	{
+		if (entries_per_run == 0) {
+			throw std::invalid_argument("entries_per_run must be positive");
+		}
+
+		stop_sweeper();
+
+		auto state = std::make_shared<sweeper_state>();
+		state->owner = this;
+		state->budget = entries_per_run;
+
+		_sweeper = pool.submit_every(interval, [state] {
+			std::scoped_lock<std::mutex> lock(state->mutex);
+			if (state->owner) {
+				state->owner->sweep(state->budget);
+			}
+		});
+		_sweeper_state = std::move(state);
+	}
+
+	// Waits for a sweep that is already running.
+	void stop_sweeper()
+	{
+		if (!_sweeper_state) {
+			return;
+		}
+
+		_sweeper.cancel();
+		{
+			std::scoped_lock<std::mutex> lock(_sweeper_state->mutex);
+			_sweeper_state->owner = nullptr;
+		}
+		_sweeper_state.reset();
+	}
+
+private:
+	// One thread moves the clock hand at a time. The others carry on
+	// unless the cache has overshot by more than EVICTION_SLACK, in which
+	// case they wait their turn so that writers cannot outrun eviction.
+	void make_room()
+	{
+		if (_list.size() <= _capacity) {
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(_hand_mutex, std::try_to_lock);
+		if (!lock.owns_lock())
+		{
+			if (_list.size() <= _capacity + EVICTION_SLACK) {
+				return;
+			}
+			lock.lock();
+		}
+
+		const size_t size = _list.size();
+		if (size > _capacity)
+		{
+			size_t expired = 0;
+			const size_t removed = _list.evict(&_hand, size - _capacity, &expired);
+			_evictions.fetch_add(removed - expired, std::memory_order_relaxed);
+			_expirations.fetch_add(expired, std::memory_order_relaxed);
+		}
+	}
+
+	static constexpr size_t EVICTION_SLACK = 64;
+	static constexpr size_t DEFAULT_SWEEP_BUDGET = 1024;
+
+	list_type _list;
+	const size_t _capacity;
+	const typename clock::duration _default_ttl;
+
+	std::mutex _hand_mutex;
+	std::optional<Key> _hand;
+	std::mutex _sweep_mutex;
+	std::optional<Key> _sweep_cursor;
+
+	std::atomic<uint64_t> _evictions{ 0 };
+	std::atomic<uint64_t> _expirations{ 0 };
+
+	thread_pool::timer_handle _sweeper;
+	std::shared_ptr<sweeper_state> _sweeper_state;
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+// Runtime-sized union-find that can be shared between threads without locks.
+// Each element is a single 64-bit word holding its rank in the upper half and
+// its parent in the lower half, so a link is one compare-and-swap and the
+// whole structure lives in one contiguous heap allocation.
+class concurrent_disjoint_set
+{
+public:
+	explicit concurrent_disjoint_set(size_t size)
+		: _size(checked_size(size))
+		, _entries(std::make_unique<std::atomic<uint64_t>[]>(_size))
+	{
+		for (size_t i = 0; i < size; ++i) {
+			_entries[i].store(make_entry(0, static_cast<uint32_t>(i)), std::memory_order_relaxed);
+		}
+	}
+
+	concurrent_disjoint_set(const concurrent_disjoint_set&) = delete;
+	concurrent_disjoint_set& operator=(const concurrent_disjoint_set&) = delete;
+
+	bool connect(size_t a, size_t b)
+	{
+		if (a >= _size || b >= _size) {
+			return false;
+		}
+
+		auto root_a = static_cast<uint32_t>(a);
+		auto root_b = static_cast<uint32_t>(b);
+
+		while (true)
+		{
+			root_a = find(root_a);
+			root_b = find(root_b);
+
+			if (root_a == root_b) {
+				return false;
+			}
+
+			auto rank_a = rank(_entries[root_a].load(std::memory_order_acquire));
+			auto rank_b = rank(_entries[root_b].load(std::memory_order_acquire));
+
+			// Always link the lower (rank, index) root below the higher one so
+			// that concurrent links can never form a cycle.
+			if (rank_a > rank_b || (rank_a == rank_b && root_a > root_b))
+			{
+				std::swap(root_a, root_b);
+				std::swap(rank_a, rank_b);
+			}
+
+			auto expected = make_entry(rank_a, root_a);
+			if (!_entries[root_a].compare_exchange_strong(
+				expected, make_entry(rank_a, root_b), std::memory_order_acq_rel))
+			{
+				continue;
+			}
+
+			if (rank_a == rank_b)
+			{
+				// Losing this race only leaves the rank slightly low, which
+				// costs balance but never correctness.
+				expected = make_entry(rank_b, root_b);
+				_entries[root_b].compare_exchange_strong(
+					expected, make_entry(rank_b + 1, root_b), std::memory_order_acq_rel);
+			}
+
+			return true;
+		}
+	}
+
+	bool is_connected(size_t a, size_t b) const
+	{
+		if (a >= _size || b >= _size) {
+			return false;
+		}
+
+		auto root_a = static_cast<uint32_t>(a);
+		auto root_b = static_cast<uint32_t>(b);
+
+		while (true)
+		{
+			root_a = find(root_a);
+			root_b = find(root_b);
+
+			if (root_a == root_b) {
+				return true;
+			}
+
+			// root_a may have been linked below another root after we found it.
+			if (parent(_entries[root_a].load(std::memory_order_acquire)) == root_a) {
+				return false;
+			}
+		}
+	}
+
+	// Like connect, checks a against size() before narrowing it to 32 bits,
+	// so an out-of-range element cannot wrap onto a valid one.
+	size_t find_root(size_t a) const
+	{
+		if (a >= _size) {
+			throw std::out_of_range("concurrent_disjoint_set element out of range");
+		}
+		return find(static_cast<uint32_t>(a));
+	}
+
+	size_t size() const
+	{
+		return _size;
+	}
+
+private:
+	// Runs in the member initializer so an oversized request is rejected
+	// before anything is allocated for it.
+	static size_t checked_size(size_t size)
+	{
+		if (size > MAX_SIZE) {
+			throw std::invalid_argument("size exceeds 32-bit index range");
+		}
+		return size;
+	}
+
+	uint32_t find(uint32_t a) const
+	{
+		while (true)
+		{
+			auto entry = _entries[a].load(std::memory_order_acquire);
+			const auto a_parent = parent(entry);
+			if (a_parent == a) {
+				return a;
+			}
+
+			// Path halving: point a at its grandparent. Failing the exchange
+			// just means someone else already shortened the path.
+			const auto grandparent = parent(_entries[a_parent].load(std::memory_order_acquire));
+			if (grandparent != a_parent)
+			{
+				_entries[a].compare_exchange_weak(
+					entry, make_entry(rank(entry), grandparent), std::memory_order_acq_rel);
+			}
+
+			a = grandparent;
+		}
+	}
+
+	static uint64_t make_entry(uint32_t rank, uint32_t parent)
+	{
+		return (static_cast<uint64_t>(rank) << 32) | parent;
+	}
+
+	static uint32_t rank(uint64_t entry)
+	{
+		return static_cast<uint32_t>(entry >> 32);
+	}
+
+	static uint32_t parent(uint64_t entry)
+	{
+		return static_cast<uint32_t>(entry);
+	}
+
+	const size_t _size;
+	const std::unique_ptr<std::atomic<uint64_t>[]> _entries;
+
+	static constexpr size_t MAX_SIZE = std::numeric_limits<uint32_t>::max();
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "concurrent_skiplist.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+// A min-priority queue that many threads can push to and pop from at once,
+// kept as a concurrent_skiplist ordered by priority. Equal priorities pop
+// in push order.
+//
+// try_pop_min always returns the smallest entry, so every popper works at
+// the front of the list. try_pop_relaxed returns one of the smallest few
+// entries instead, which spreads poppers out and scales further when the
+// caller can tolerate slightly out-of-order results, as schedulers usually
+// can.
+template <typename Priority, typename Value>
+class concurrent_priority_queue
+{
+	// The sequence number makes every key unique and breaks ties in push
+	// order.
+	using key = std::pair<Priority, uint64_t>;
+
+public:
+	// threads is the number of threads expected to pop concurrently; it only
+	// sets how far try_pop_relaxed may reach from the front.
+	explicit concurrent_priority_queue(size_t threads = std::thread::hardware_concurrency())
+		: _spread(spray_width(threads))
+	{
+	}
+
+	concurrent_priority_queue(const concurrent_priority_queue&) = delete;
+	concurrent_priority_queue& operator=(const concurrent_priority_queue&) = delete;
+
+	void push(Priority priority, Value value)
+	{
+		_list.try_add({ std::move(priority), _sequence.fetch_add(1, std::memory_order_relaxed) }, std::move(value));
+	}
+
+	bool try_pop_min(Priority* out_priority, Value* out_value)
+	{
+		return pop(out_priority, out_value, /*relaxed*/false);
+	}
+
+	// Pops one of roughly the first threads * log2(threads) entries.
+	bool try_pop_relaxed(Priority* out_priority, Value* out_value)
+	{
+		return pop(out_priority, out_value, /*relaxed*/true);
+	}
+
+	// Approximate while other threads push or pop.
+	size_t size() const
+	{
+		return _list.size();
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+private:
+	bool pop(Priority* out_priority, Value* out_value, bool relaxed)
+	{
+		if (out_priority == nullptr || out_value == nullptr) {
+			throw std::invalid_argument("out_priority or out_value is null");
+		}
+
+		key popped;
+		const bool found = relaxed
+			? _list.try_pop_near_front(_spread, &popped, out_value)
+			: _list.try_pop_front(&popped, out_value);
+
+		if (found) {
+			*out_priority = std::move(popped.first);
+		}
+		return found;
+	}
+
+	// The SprayList analysis spreads p poppers over O(p log^3 p) entries;
+	// p log p keeps results closer to the front and in practice already
+	// makes collisions rare.
+	static size_t spray_width(size_t threads)
+	{
+		threads = std::max<size_t>(threads, 1);
+		size_t log = 1;
+		while ((size_t(1) << log) < threads) {
+			++log;
+		}
+		return threads * log;
+	}
+
+	concurrent_skiplist<key, Value> _list;
+	std::atomic<uint64_t> _sequence{ 0 };
+	const size_t _spread;
+};
@@ -1,32 +1,123 @@
 #pragma once
 
+#include "epoch_reclaimer.h"
+#include "trace.h"
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <random>
 #include <shared_mutex>
 #include <stdexcept>
+#include <thread>
+#include <tuple>
 #include <utility>
 
-template <typename Key, typename Value>
+// Each node is promoted to the next level with probability 1/BranchingFactor.
+// Larger factors give shorter towers and less memory per node at the cost of
+// longer walks along each level.
+template <typename Key, typename Value, unsigned BranchingFactor = 2>
 class concurrent_skiplist
 {
-	using transferable_lock = std::unique_lock<std::mutex>;
+	static_assert(BranchingFactor >= 2, "BranchingFactor must be at least 2");
+
+public:
+	using clock = std::chrono::steady_clock;
+
+private:
+	static constexpr int BOTTOM_LEVEL = 0;
+	static constexpr int MAX_LEVELS = 32;
+	static constexpr int LEVEL_CAP = MAX_LEVELS - 1;
+	static constexpr size_t COUNTER_STRIPES = 16;
+	static constexpr size_t SEARCH_PATH_SAMPLES = 1024;
+	static constexpr size_t BOTTOM_SPREAD = 8;
+	// Expiry of an entry written without a time to live.
+	static constexpr int64_t NEVER = std::numeric_limits<int64_t>::max();
+
+	// Never matches a level's version, so validating against it always
+	// fails.
+	static constexpr uint64_t UNSEEN_VERSION = std::numeric_limits<uint64_t>::max();
+
+	// A blocking mutex in one word, so that a lock per level does not
+	// triple the size of a link as std::mutex would. A contended lock()
+	// sleeps in atomic::wait rather than spinning; unlock() wakes a sleeper
+	// only if one has announced itself by setting the state to CONTENDED.
+	class link_mutex
+	{
+	public:
+		void lock()
+		{
+			uint32_t state = UNLOCKED;
+			if (_state.compare_exchange_strong(state, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+				return;
+			}
+
+			while (_state.exchange(CONTENDED, std::memory_order_acquire) != UNLOCKED) {
+				_state.wait(CONTENDED, std::memory_order_relaxed);
+			}
+		}
+
+		bool try_lock()
+		{
+			uint32_t state = UNLOCKED;
+			return _state.compare_exchange_strong(state, LOCKED, std::memory_order_acquire, std::memory_order_relaxed);
+		}
+
+		void unlock()
+		{
+			if (_state.exchange(UNLOCKED, std::memory_order_release) == CONTENDED) {
+				_state.notify_one();
+			}
+		}
+
+	private:
+		static constexpr uint32_t UNLOCKED = 0;
+		static constexpr uint32_t LOCKED = 1;
+		static constexpr uint32_t CONTENDED = 2;
+
+		std::atomic<uint32_t> _state{ UNLOCKED };
+	};
+
+	using transferable_lock = std::unique_lock<link_mutex>;
+	using exclusive_lock = std::unique_lock<std::mutex>;
 
 	class node
 	{
+		// Above level 0 the version advances, under the lock, every time next
+		// changes. A writer that read it before reading next can tell once it
+		// holds the lock whether next is still what it saw.
+		//
+		// Level 0 is linked by compare-and-swap instead, so inserts take no
+		// lock there. An unlinker first sets the low bit of the node's own
+		// level-0 pointer; from then on no insert can link behind the node.
+		// forward() strips the bit.
+		struct link
+		{
+			std::atomic<node*> next{ nullptr };
+			std::atomic<uint64_t> version{ 0 };
+			link_mutex lock;
+		};
+
 	public:
-		node(int levels) : node(Key{}, Value{}, levels)
+		node(int levels) : node(Key{}, Value{}, levels, NEVER)
 		{
 		}
 
-		node(Key key, Value&& value, int levels)
+		node(Key key, Value&& value, int levels, int64_t expires_at)
 			: _key(std::move(key))
-			, _forward(std::make_unique<node*[]>(levels))
-			, _forward_mutexes(std::make_unique<std::mutex[]>(levels))
+			, _links(std::make_unique<link[]>(levels))
 			, _top_level(levels - 1)
 			, _value(std::move(value))
+			, _expires_at(expires_at)
 		{
 		}
 
@@ -47,24 +138,119 @@ class concurrent_skiplist
 			_value = std::move(value);
 		}
 
+		// Only for a node no other thread can see yet.
+		Value take_value()
+		{
+			return std::move(_value);
+		}
+
 		node* forward(int level) const
 		{
-			return _forward[level];
+			return unmarked(_links[level].next.load(std::memory_order_acquire));
 		}
 
+		// Keeps the mark, if the link has one.
 		void set_forward(node* next, int level)
 		{
-			_forward[level] = next;
+			auto& link = _links[level];
+			link.next.store(with_mark_of(next, link.next.load(std::memory_order_relaxed)), std::memory_order_release);
+			link.version.store(link.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		// Links inserted after this node if next is still expected and this
+		// node is not being unlinked.
+		bool try_link(node* inserted, node* expected, int level)
+		{
+			inserted->_links[level].next.store(expected, std::memory_order_relaxed);
+			return _links[level].next.compare_exchange_strong(expected, inserted, std::memory_order_release, std::memory_order_relaxed);
+		}
+
+		// Swings next from expected to replacement, which fails if an insert
+		// got in first or this node is being unlinked. Needs the lock.
+		bool try_replace_forward(node* expected, node* replacement, int level)
+		{
+			auto& link = _links[level];
+			if (!link.next.compare_exchange_strong(expected, replacement, std::memory_order_release, std::memory_order_relaxed)) {
+				return false;
+			}
+			link.version.store(link.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Stops inserts linking behind this node and returns its successor,
+		// which cannot change afterwards.
+		node* mark_forward(int level)
+		{
+			auto& next = _links[level].next;
+			node* raw = next.load(std::memory_order_relaxed);
+			while (!is_marked(raw)
+				&& !next.compare_exchange_weak(raw, marked(raw), std::memory_order_acq_rel, std::memory_order_relaxed)) {
+			}
+			return unmarked(raw);
+		}
+
+		bool being_unlinked(int level) const
+		{
+			return is_marked(_links[level].next.load(std::memory_order_relaxed));
+		}
+
+		uint64_t version(int level) const
+		{
+			return _links[level].version.load(std::memory_order_acquire);
 		}
 
 		transferable_lock lock(int level)
 		{
-			return transferable_lock(_forward_mutexes[level]);
+			return transferable_lock(_links[level].lock);
+		}
+
+		transferable_lock try_lock(int level)
+		{
+			return transferable_lock(_links[level].lock, std::try_to_lock);
+		}
+
+		// Marks the entry removed. Exactly one caller gets true and becomes
+		// responsible for unlinking the node.
+		bool try_claim()
+		{
+			return !_claimed.exchange(true, std::memory_order_acq_rel);
+		}
+
+		bool claimed() const
+		{
+			return _claimed.load(std::memory_order_acquire);
+		}
+
+		exclusive_lock lock_for_modify()
+		{
+			return exclusive_lock(_modify_mutex);
+		}
+
+		void set_expiry(int64_t expires_at)
+		{
+			_expires_at.store(expires_at, std::memory_order_relaxed);
+		}
+
+		// Only entries with a time to live read the clock.
+		bool expired() const
+		{
+			const auto expires_at = _expires_at.load(std::memory_order_relaxed);
+			return expires_at != NEVER && expires_at <= clock::now().time_since_epoch().count();
+		}
+
+		// The bit is only written when it changes, so lookups of a hot entry
+		// do not keep taking its cache line away from other readers.
+		void mark_referenced() const
+		{
+			if (!_referenced.load(std::memory_order_relaxed)) {
+				_referenced.store(true, std::memory_order_relaxed);
+			}
 		}
 
-		transferable_lock lock_for_modify()
+		bool test_and_clear_referenced() const
 		{
-			return transferable_lock(_modify_mutex);
+			return _referenced.load(std::memory_order_relaxed)
+				&& _referenced.exchange(false, std::memory_order_relaxed);
 		}
 
 		int top_level() const
@@ -72,45 +258,81 @@ class concurrent_skiplist
 			return _top_level;
 		}
 
+		static constexpr size_t link_size()
+		{
+			return sizeof(link);
+		}
+
 	private:
+		static constexpr uintptr_t MARK = 1;
+
+		static bool is_marked(node* raw)
+		{
+			return (reinterpret_cast<uintptr_t>(raw) & MARK) != 0;
+		}
+
+		static node* marked(node* raw)
+		{
+			return reinterpret_cast<node*>(reinterpret_cast<uintptr_t>(raw) | MARK);
+		}
+
+		static node* unmarked(node* raw)
+		{
+			return reinterpret_cast<node*>(reinterpret_cast<uintptr_t>(raw) & ~MARK);
+		}
+
+		static node* with_mark_of(node* next, node* raw)
+		{
+			return is_marked(raw) ? marked(next) : next;
+		}
+
 		const Key _key;
-		std::unique_ptr<node* []> _forward;
-		std::unique_ptr<std::mutex[]> _forward_mutexes;
+		std::unique_ptr<link[]> _links;
 		const int _top_level;
 		Value _value;
 		mutable std::shared_mutex _value_mutex;
 		std::mutex _modify_mutex;
+		std::atomic<bool> _claimed{ false };
+		std::atomic<int64_t> _expires_at;
+		// Set by lookups and cleared by evict's clock hand. New entries start
+		// referenced so the hand does not take them before anyone could read
+		// them.
+		mutable std::atomic<bool> _referenced{ true };
 	};
 
 	class top_level_generator
 	{
 	public:
 		top_level_generator(int level_cap)
-			: _distribution(0, (1ULL << level_cap) - 1)
+			: _level_cap(level_cap)
 		{
 		}
 
+		// Each thread draws from its own engine so inserts do not serialise
+		// on a shared one.
 		int get()
 		{
-			uint64_t bits;
-			{
-				std::scoped_lock<std::mutex> lock(_random_engine_mutex);
-				bits = _distribution(_generator);
-			}
-			
+			thread_local std::mt19937_64 generator{ std::random_device{}() };
+			std::uniform_int_distribution<unsigned> distribution(0, BranchingFactor - 1);
+
 			int top_level = 0;
-			while (bits & 1)
-			{
+			while (top_level < _level_cap && distribution(generator) == 0) {
 				++top_level;
-				bits >>= 1;
 			}
 			return top_level;
 		}
 
 	private:
-		std::mutex _random_engine_mutex;
-		std::default_random_engine _generator;
-		const std::uniform_int_distribution<uint64_t> _distribution;
+		const int _level_cap;
+	};
+
+	// Counters are spread over cache lines and each thread updates one of
+	// them, so writers on different threads do not bounce a shared line.
+	struct alignas(64) counter_stripe
+	{
+		std::atomic<int64_t> size{ 0 };
+		std::atomic<int64_t> nodes{ 0 };
+		std::atomic<int64_t> links{ 0 };
 	};
 
 public:
@@ -129,14 +351,21 @@ public:
 			delete current;
 			current = next;
 		}
+
+		// Removed nodes may still be waiting on other threads' lists.
+		epoch_reclaimer::collect_all();
 	}
 
+	// Takes no lock other than the entry's value lock: the epoch guard keeps
+	// removed nodes alive under the walk, and the only write is the entry's
+	// reference bit.
 	bool try_get_value(const Key& key, Value* out_value) const
 	{
 		if (out_value == nullptr) {
 			throw std::invalid_argument("out_value is null");
 		}
 
+		const auto guard = epoch_reclaimer::pin();
 		node* current = _head;
 		node* next = nullptr;
 
@@ -150,8 +379,9 @@ public:
 			}
 		}
 
-		if (compare_equal(next, key))
+		if (compare_equal(next, key) && !next->claimed() && !next->expired())
 		{
+			next->mark_referenced();
 			*out_value = next->value();
 			return true;
 		}
@@ -159,27 +389,281 @@ public:
 		return false;
 	}
 
-	void add_or_update(const Key& key, Value value)
+	// Returns true if the key was added and false if an existing value was
+	// replaced.
+	bool add_or_update(const Key& key, Value value)
 	{
-		add_or_update(key, value, /*add*/true, /*update*/true);
+		bool added = false;
+		add_or_update(key, value, NEVER, /*add*/true, /*update*/true, &added);
+		return added;
 	}
 
 	bool try_add(const Key& key, Value value)
 	{
-		return add_or_update(key, value, /*add*/true, /*update*/false);
+		return add_or_update(key, value, NEVER, /*add*/true, /*update*/false);
 	}
 
 	bool try_update(const Key& key, Value value)
 	{
-		return add_or_update(key, value, /*add*/false, /*update*/true);
+		return add_or_update(key, value, NEVER, /*add*/false, /*update*/true);
+	}
+
+	// The overloads taking ttl write an entry that expires ttl from now.
+	// An expired entry is absent to lookups and iteration straight away and
+	// is removed by remove_expired, evict or the next write of its key. Every
+	// write sets the expiry afresh, so writing without a ttl makes the entry
+	// permanent again.
+	bool add_or_update(const Key& key, Value value, clock::duration ttl)
+	{
+		bool added = false;
+		add_or_update(key, value, expiry_after(ttl), /*add*/true, /*update*/true, &added);
+		return added;
+	}
+
+	bool try_add(const Key& key, Value value, clock::duration ttl)
+	{
+		return add_or_update(key, value, expiry_after(ttl), /*add*/true, /*update*/false);
+	}
+
+	bool try_update(const Key& key, Value value, clock::duration ttl)
+	{
+		return add_or_update(key, value, expiry_after(ttl), /*add*/false, /*update*/true);
+	}
+
+	// Forward iterator over the entries in ascending key order. Writers may
+	// run concurrently: each key is visited at most once, entries added or
+	// removed during the walk may or may not be seen, and every value seen
+	// was current at some point during the walk. Expired entries are skipped.
+	// An iterator holds an epoch guard, so removed nodes are not freed while
+	// it lives; it must stay on the thread that created it.
+	class const_iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = std::pair<Key, Value>;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const value_type*;
+		using reference = value_type;
+
+		const_iterator() = default;
+
+		const Key& key() const { return _current->key(); }
+		Value value() const { return _current->value(); }
+		value_type operator*() const { return { key(), value() }; }
+
+		const_iterator& operator++()
+		{
+			const node* last_visited = _current;
+			const node* current = _current->forward(BOTTOM_LEVEL);
+
+			while (current)
+			{
+				const node* next = current->forward(BOTTOM_LEVEL);
+
+				// A removed node points back at its old predecessor; following
+				// it leads back onto the live list.
+				if (_list->compare_greater(current, next)) {
+					current = next == _list->_head ? _list->_head->forward(BOTTOM_LEVEL) : next;
+				}
+				else if (_list->compare_less(last_visited, current)
+					&& !current->claimed()
+					&& (_include_expired || !current->expired())) {
+					break;
+				}
+				else {
+					current = next;
+				}
+			}
+
+			_current = current;
+			return *this;
+		}
+
+		bool operator==(const const_iterator& other) const { return _current == other._current; }
+		bool operator!=(const const_iterator& other) const { return _current != other._current; }
+
+	private:
+		friend class concurrent_skiplist;
+
+		const_iterator(const concurrent_skiplist* list, const node* current)
+			: _list(list)
+			, _current(current)
+		{
+		}
+
+		const_iterator(const concurrent_skiplist* list, const node* current, epoch_reclaimer::guard guard, bool include_expired)
+			: _list(list)
+			, _current(current)
+			, _guard(std::move(guard))
+			, _include_expired(include_expired)
+		{
+		}
+
+		node* mutable_node() const
+		{
+			return const_cast<node*>(_current);
+		}
+
+		const concurrent_skiplist* _list = nullptr;
+		const node* _current = nullptr;
+		epoch_reclaimer::guard _guard;
+		bool _include_expired = false;
+	};
+
+	const_iterator begin() const
+	{
+		// Stepping off the head applies the same removed-node checks as
+		// every later step.
+		return ++const_iterator(this, _head, epoch_reclaimer::pin(), /*include_expired*/false);
+	}
+
+	// The first entry whose key is not less than key.
+	const_iterator lower_bound(const Key& key) const
+	{
+		return lower_bound(key, /*include_expired*/false);
+	}
+
+	const_iterator end() const
+	{
+		return const_iterator(this, nullptr);
+	}
+
+	// Calls f(key, value) for every entry, with the guarantees of
+	// const_iterator.
+	template<typename Function>
+	void for_each(Function f) const
+	{
+		for (auto it = begin(); it != end(); ++it) {
+			f(it.key(), it.value());
+		}
+	}
+
+	// Fills an empty list from (key, value) pairs in strictly ascending key
+	// order in linear time, linking each node at the tail of every level it
+	// occupies instead of searching for its position. No other thread may use
+	// the list until this returns.
+	template<typename Iterator>
+	void bulk_build(Iterator first, Iterator last)
+	{
+		if (_head->forward(BOTTOM_LEVEL) != nullptr) {
+			throw std::logic_error("bulk_build requires an empty list");
+		}
+
+		std::array<node*, MAX_LEVELS> tails;
+		tails.fill(_head);
+
+		for (; first != last; ++first)
+		{
+			auto&& entry = *first;
+			const Key& key = std::get<0>(entry);
+			if (tails[BOTTOM_LEVEL] != _head && !(tails[BOTTOM_LEVEL]->key() < key)) {
+				throw std::invalid_argument("bulk_build keys are not strictly ascending");
+			}
+
+			const auto top_level = top_level_generator.get();
+			Value value(std::get<1>(std::forward<decltype(entry)>(entry)));
+			auto* current = new node(key, std::move(value), top_level + 1, NEVER);
+			for (int i = BOTTOM_LEVEL; i <= top_level; ++i)
+			{
+				tails[i]->set_forward(current, i);
+				tails[i] = current;
+			}
+			count_added(top_level + 1);
+		}
+
+		increase_top_level_hint();
+	}
+
+	// Number of entries, counting expired ones not yet removed. Exact when no
+	// writer is running; otherwise a recent approximation that costs a read
+	// of each counter stripe.
+	size_t size() const
+	{
+		int64_t total = 0;
+		for (const auto& stripe : _counters) {
+			total += stripe.size.load(std::memory_order_relaxed);
+		}
+		return total > 0 ? static_cast<size_t>(total) : 0;
+	}
+
+	// Approximate bytes held by the list's nodes. A removed node stops
+	// counting when it is unlinked, although it is freed only once no reader
+	// can still be on it. Memory that keys and values allocate themselves is
+	// not included.
+	size_t memory_bytes() const
+	{
+		int64_t nodes = 0;
+		int64_t links = 0;
+		for (const auto& stripe : _counters)
+		{
+			nodes += stripe.nodes.load(std::memory_order_relaxed);
+			links += stripe.links.load(std::memory_order_relaxed);
+		}
+		return sizeof(*this)
+			+ static_cast<size_t>(nodes + 1) * sizeof(node)
+			+ static_cast<size_t>(links + MAX_LEVELS) * node::link_size();
+	}
+
+	struct stats_snapshot
+	{
+		size_t size;
+		size_t memory_bytes;
+		int top_level;
+		// height_histogram[h] is the number of entries whose tower is h + 1
+		// levels tall.
+		std::array<size_t, MAX_LEVELS> height_histogram;
+		// Mean number of nodes a lookup visits, over a sample of the keys.
+		double average_search_path;
+	};
+
+	// Walks the whole list, so meant for monitoring rather than hot paths.
+	// Tower heights should fall off by BranchingFactor per level and the
+	// search path should grow with the log of the size; a list that drifts
+	// from that has degraded.
+	stats_snapshot stats() const
+	{
+		stats_snapshot result{};
+		result.memory_bytes = memory_bytes();
+		result.top_level = _top_level_hint;
+
+		const size_t stride = std::max<size_t>(1, size() / SEARCH_PATH_SAMPLES);
+		size_t index = 0;
+		size_t sampled = 0;
+		size_t visited = 0;
+
+		for (auto it = begin(); it != end(); ++it, ++index)
+		{
+			++result.height_histogram[it._current->top_level()];
+			if (index % stride == 0)
+			{
+				visited += search_path_length(it.key());
+				++sampled;
+			}
+		}
+
+		result.size = index;
+		result.average_search_path = sampled ? static_cast<double>(visited) / sampled : 0.0;
+		return result;
+	}
+
+	// Number of times a writer found a lock it needed held, or found the
+	// list changed under it and had to move on or retry its swap. A rough
+	// measure of how much writers are getting in each other's way.
+	uint64_t contention_count() const
+	{
+		return _contention.load(std::memory_order_relaxed);
 	}
 
 	bool try_remove(const Key& key)
 	{
+		TRACE_SPAN("skiplist", "remove");
+
+		const auto guard = epoch_reclaimer::pin();
 		std::array<node*, MAX_LEVELS> update;
+		std::array<uint64_t, MAX_LEVELS> versions;
 		const auto top_level_hint = _top_level_hint;
-		node* current = search(key, top_level_hint, &update);
-		transferable_lock modify_lock;
+		node* current = search(key, top_level_hint, &update, &versions);
+		exclusive_lock modify_lock;
 
 		while (true)
 		{
@@ -198,102 +682,493 @@ public:
 			modify_lock.unlock();
 		}
 
+		// The entry may have been popped and not yet unlinked.
+		if (!current->try_claim()) {
+			return false;
+		}
+
+		unlink(current, std::move(modify_lock), &update, &versions, top_level_hint);
+		return true;
+	}
+
+	// Removes the smallest entry and returns it through the out parameters,
+	// or returns false if the list is empty. Concurrent callers each get a
+	// different entry.
+	bool try_pop_front(Key* out_key, Value* out_value)
+	{
+		return claim_from(_head, out_key, out_value);
+	}
+
+	// Like try_pop_front, but removes an entry picked roughly uniformly from
+	// the first spread entries instead of always the first, in the manner of
+	// the SprayList. Poppers then rarely collide on the same node, at the
+	// cost of an entry up to spread places from the front being returned.
+	// The walk descends from a level chosen so the random steps taken on the
+	// way down reach about spread entries. Level 0 takes a longer walk than
+	// the levels above so that short nodes are as likely to be picked as
+	// tall ones; otherwise tall nodes near the front would be used up first
+	// and the entries left behind would drift ever further from the front.
+	bool try_pop_near_front(size_t spread, Key* out_key, Value* out_value)
+	{
+		if (spread <= 1) {
+			return try_pop_front(out_key, out_value);
+		}
+
+		// Level 0 walks up to BOTTOM_SPREAD nodes; each level above
+		// multiplies the reach by BranchingFactor.
+		const size_t bottom_spread = std::min<size_t>(spread, BOTTOM_SPREAD * BranchingFactor);
+		int start_level = 0;
+		for (size_t width = bottom_spread * BranchingFactor; width <= spread && start_level < _top_level_hint; width *= BranchingFactor) {
+			++start_level;
+		}
+
+		thread_local std::mt19937_64 generator{ std::random_device{}() };
+
+		const auto guard = epoch_reclaimer::pin();
+		node* current = _head;
+		for (int i = start_level; i >= BOTTOM_LEVEL; --i)
+		{
+			const size_t range = i == BOTTOM_LEVEL ? bottom_spread : BranchingFactor;
+			for (size_t n = std::uniform_int_distribution<size_t>(0, range - 1)(generator); n > 0; --n)
+			{
+				node* next = current->forward(i);
+				// Stop at the end or at a node unlinked at this level.
+				if (next == nullptr || compare_greater(next, next->forward(i))) {
+					break;
+				}
+				current = next;
+			}
+		}
+
+		return claim_from(current, out_key, out_value) || try_pop_front(out_key, out_value);
+	}
+
+	// Removes the expired entries among the next budget entries from *cursor
+	// on, starting at the front when *cursor is empty, and leaves *cursor at
+	// the entry to look at next, or empty once the end is reached. Calling it
+	// repeatedly sweeps the list a slice at a time. Returns the number
+	// removed.
+	size_t remove_expired(std::optional<Key>* cursor, size_t budget)
+	{
+		size_t removed = 0;
+		visit_from(cursor, budget, [&](node* current) {
+			if (current->expired() && remove_node(current, [](const node* n) { return n->expired(); })) {
+				++removed;
+			}
+			return true;
+		});
+		return removed;
+	}
+
+	// Removes up to count entries chosen by the CLOCK approximation of least
+	// recently used. *hand moves around the list in key order, wrapping at
+	// the end: an entry read since the hand last passed it has its reference
+	// bit cleared and is kept, and the first count entries found unreferenced
+	// or expired are removed. Gives up after two laps, by which point every
+	// bit has been cleared, so it returns fewer than count only when the list
+	// runs out of entries. Returns the number removed, of which
+	// *out_expired, if given, receives the number that had expired.
+	size_t evict(std::optional<Key>* hand, size_t count, size_t* out_expired = nullptr)
+	{
+		size_t removed = 0;
+		size_t expired = 0;
+		size_t budget = 2 * size() + 2;
+
+		while (removed < count && budget > 0)
+		{
+			const bool from_front = !hand->has_value();
+			const size_t examined = visit_from(hand, budget, [&](node* current) {
+				const bool is_expired = current->expired();
+				if ((is_expired || !current->test_and_clear_referenced())
+					&& remove_node(current, [](const node*) { return true; }))
+				{
+					++removed;
+					expired += is_expired;
+				}
+				return removed < count;
+			});
+
+			if (examined == 0 && from_front) {
+				break;
+			}
+			budget -= std::min(budget, examined);
+		}
+
+		if (out_expired) {
+			*out_expired = expired;
+		}
+		return removed;
+	}
+
+private:
+	// Walks level 0 from start and removes the first entry it manages to
+	// claim.
+	bool claim_from(node* start, Key* out_key, Value* out_value)
+	{
+		if (out_key == nullptr || out_value == nullptr) {
+			throw std::invalid_argument("out_key or out_value is null");
+		}
+
+		TRACE_SPAN("skiplist", "pop");
+
+		const auto guard = epoch_reclaimer::pin();
+		node* current = start == _head ? _head->forward(BOTTOM_LEVEL) : start;
+		while (current)
+		{
+			node* next = current->forward(BOTTOM_LEVEL);
+
+			// Removed nodes point back at their old predecessor, which leads
+			// back onto the live list.
+			if (compare_greater(current, next))
+			{
+				current = next == _head ? _head->forward(BOTTOM_LEVEL) : next;
+				continue;
+			}
+
+			// Claimed under the modify lock, like every other remover, so a
+			// write to the entry lands either before the pop or not at all.
+			if (!current->claimed())
+			{
+				auto modify_lock = current->lock_for_modify();
+				const bool is_garbage = compare_greater(current, current->forward(BOTTOM_LEVEL));
+				if (!is_garbage && current->try_claim())
+				{
+					*out_key = current->key();
+					*out_value = current->value();
+
+					std::array<node*, MAX_LEVELS> update;
+					std::array<uint64_t, MAX_LEVELS> versions;
+					const auto top_level_hint = _top_level_hint;
+					search(current->key(), top_level_hint, &update, &versions);
+					unlink(current, std::move(modify_lock), &update, &versions, top_level_hint);
+					return true;
+				}
+			}
+
+			current = next;
+		}
+
+		return false;
+	}
+
+	// Unlinks a node the caller has claimed, top level first. modify_lock
+	// waits out an insert that is still linking the node's upper levels.
+	void unlink(
+		node* current,
+		exclusive_lock modify_lock,
+		std::array<node*, MAX_LEVELS>* update,
+		std::array<uint64_t, MAX_LEVELS>* versions,
+		int top_level_hint)
+	{
+		const Key& key = current->key();
+
 		for (int i = top_level_hint + 1; i <= current->top_level(); ++i)
 		{
-			update[i] = _head;
+			(*update)[i] = _head;
+			(*versions)[i] = UNSEEN_VERSION;
 		}
 
-		for (int i = current->top_level(); i >= BOTTOM_LEVEL; --i)
+		for (int i = current->top_level(); i > BOTTOM_LEVEL; --i)
 		{
-			node* previous = update[i];
-			const auto previous_lock = find_and_lock(&previous, key, i);
+			node* previous = (*update)[i];
+			const auto previous_lock = lock_predecessor(&previous, (*versions)[i], key, i);
 			const auto current_lock = current->lock(i);
 			previous->set_forward(current->forward(i), i);
 			current->set_forward(previous, i);
 		}
 
-		// todo: put current in garbage queue
+		unlink_bottom(current, (*update)[BOTTOM_LEVEL]);
 
 		modify_lock.unlock();
 		decrease_top_level_hint();
 
+		auto& stripe = local_counters();
+		stripe.size.fetch_sub(1, std::memory_order_relaxed);
+		stripe.nodes.fetch_sub(1, std::memory_order_relaxed);
+		stripe.links.fetch_sub(current->top_level() + 1, std::memory_order_relaxed);
+
+		// Readers already on the node can still step off it through its
+		// back pointers; it is freed once they have all left.
+		epoch_reclaimer::retire(current);
+	}
+
+	// The locks at level 0 only order unlinkers among themselves; inserts
+	// link there by compare-and-swap and do not take them. Once current is
+	// marked nothing can be linked behind it, but an insert can still land
+	// in front of it, which the swing of the predecessor detects.
+	void unlink_bottom(node* current, node* previous)
+	{
+		const Key& key = current->key();
+		while (true)
+		{
+			const auto previous_lock = find_and_lock(&previous, key, BOTTOM_LEVEL);
+			const auto current_lock = current->lock(BOTTOM_LEVEL);
+			node* next = current->mark_forward(BOTTOM_LEVEL);
+			if (previous->try_replace_forward(current, next, BOTTOM_LEVEL))
+			{
+				current->set_forward(previous, BOTTOM_LEVEL);
+				return;
+			}
+
+			// An insert landed in front of current, or previous is itself
+			// being unlinked; either way the walk finds the new predecessor.
+			_contention.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Removes a node found by a walk if it is still linked and pred holds
+	// under its modify lock. Writes to an existing entry take the same lock,
+	// so one cannot land between the check and the removal.
+	template<typename Predicate>
+	bool remove_node(node* current, Predicate pred)
+	{
+		auto modify_lock = current->lock_for_modify();
+		const bool is_garbage = compare_greater(current, current->forward(BOTTOM_LEVEL));
+		if (is_garbage || !pred(current) || !current->try_claim()) {
+			return false;
+		}
+
+		std::array<node*, MAX_LEVELS> update;
+		std::array<uint64_t, MAX_LEVELS> versions;
+		const auto top_level_hint = _top_level_hint;
+		search(current->key(), top_level_hint, &update, &versions);
+		unlink(current, std::move(modify_lock), &update, &versions, top_level_hint);
 		return true;
 	}
 
-private:
+	const_iterator lower_bound(const Key& key, bool include_expired) const
+	{
+		auto guard = epoch_reclaimer::pin();
+		const node* current = _head;
+
+		for (int i = _top_level_hint; i >= BOTTOM_LEVEL; --i)
+		{
+			const node* next = current->forward(i);
+			while (compare_less(next, key))
+			{
+				current = next;
+				next = current->forward(i);
+			}
+		}
+
+		return ++const_iterator(this, current, std::move(guard), include_expired);
+	}
+
+	// Calls visit(node*) on up to budget entries, expired ones included,
+	// from *cursor on, stopping early if visit returns false, and moves
+	// *cursor to the next entry. Returns the number visited.
+	template<typename Visit>
+	size_t visit_from(std::optional<Key>* cursor, size_t budget, Visit visit)
+	{
+		auto it = cursor->has_value()
+			? lower_bound(**cursor, /*include_expired*/true)
+			: ++const_iterator(this, _head, epoch_reclaimer::pin(), /*include_expired*/true);
+
+		size_t visited = 0;
+		bool keep_going = true;
+		while (keep_going && visited < budget && it != end())
+		{
+			node* current = it.mutable_node();
+			++it;
+			++visited;
+			keep_going = visit(current);
+		}
+
+		if (it == end()) {
+			cursor->reset();
+		}
+		else {
+			*cursor = it.key();
+		}
+		return visited;
+	}
+
+	static int64_t expiry_after(clock::duration ttl)
+	{
+		if (ttl <= clock::duration::zero()) {
+			throw std::invalid_argument("ttl must be positive");
+		}
+
+		const auto now = clock::now().time_since_epoch();
+		return ttl < clock::duration::max() - now ? (now + ttl).count() : NEVER;
+	}
+
 	bool add_or_update(
 		const Key& search_key,
 		Value& value,
+		int64_t expires_at,
 		bool add_if_no_exist,
-		bool update_if_exist)
+		bool update_if_exist,
+		bool* added = nullptr)
 	{
-		std::array<node*, MAX_LEVELS> update;
-		auto top_level_hint = _top_level_hint;
-		auto previous = search(search_key, top_level_hint, &update);
-		auto previous_lock = find_and_lock(&previous, search_key, BOTTOM_LEVEL);
-		auto current = previous->forward(BOTTOM_LEVEL);
+		TRACE_SPAN("skiplist", "add_or_update");
 
-		if (compare_equal(current, search_key))
+		const auto guard = epoch_reclaimer::pin();
+		std::array<node*, MAX_LEVELS> update;
+		std::array<uint64_t, MAX_LEVELS> versions;
+		int top_level_hint;
+		int top_level = 0;
+		node* inserted = nullptr;
+		exclusive_lock modify_lock;
+
+		// The new node goes into level 0 with one compare-and-swap, under its
+		// own modify lock so that a remover waits until its upper levels are
+		// linked too. A failed swap means another writer changed the spot,
+		// and the search starts over.
+		while (true)
 		{
-			if (update_if_exist)
+			top_level_hint = _top_level_hint;
+			node* previous = search(search_key, top_level_hint, &update, &versions);
+			node* current = previous->forward(BOTTOM_LEVEL);
+
+			// An insert may have landed behind previous since the search.
+			while (compare_less(current, search_key))
 			{
-				current->set_value(std::move(value));
-				return true;
+				previous = current;
+				current = previous->forward(BOTTOM_LEVEL);
 			}
-			return false;
-		}
 
-		if (!add_if_no_exist) {
-			return false;
-		}
+			if (compare_equal(current, search_key))
+			{
+				if (inserted)
+				{
+					modify_lock.unlock();
+					value = inserted->take_value();
+					delete inserted;
+					inserted = nullptr;
+				}
+
+				// Existing entries are written under their modify lock, which
+				// removers hold while they decide to claim. A claimed node is
+				// gone as far as callers can tell; let its remover unlink it
+				// rather than updating or colliding with it.
+				if (!current->claimed())
+				{
+					const auto existing_lock = current->lock_for_modify();
+					if (!current->claimed()) {
+						return write_existing(current, value, expires_at, add_if_no_exist, update_if_exist);
+					}
+				}
+
+				std::this_thread::yield();
+				continue;
+			}
 
-		const auto top_level = top_level_generator.get();
-		current = new node(search_key, std::move(value), top_level + 1);
-		auto modify_lock = current->lock_for_modify();
+			if (!add_if_no_exist) {
+				return false;
+			}
+
+			if (!inserted)
+			{
+				top_level = top_level_generator.get();
+				inserted = new node(search_key, std::move(value), top_level + 1, expires_at);
+				modify_lock = inserted->lock_for_modify();
+			}
+
+			if (previous->try_link(inserted, current, BOTTOM_LEVEL)) {
+				break;
+			}
+
+			// Give a remover of previous, which may be waiting for a lock,
+			// the chance to finish.
+			_contention.fetch_add(1, std::memory_order_relaxed);
+			if (previous->being_unlinked(BOTTOM_LEVEL)) {
+				std::this_thread::yield();
+			}
+		}
 
 		for (int i = top_level_hint + 1; i <= top_level; ++i)
 		{
 			update[i] = _head;
+			versions[i] = UNSEEN_VERSION;
 		}
 
-		for (int i = 0; i <= top_level; ++i)
+		for (int i = BOTTOM_LEVEL + 1; i <= top_level; ++i)
 		{
-			if (i != BOTTOM_LEVEL)
-			{
-				previous = update[i];
-				previous_lock = find_and_lock(&previous, search_key, i);
-			}
-			current->set_forward(previous->forward(i), i);
-			previous->set_forward(current, i);
-			previous_lock.unlock();
+			node* previous = update[i];
+			const auto previous_lock = lock_predecessor(&previous, versions[i], search_key, i);
+			inserted->set_forward(previous->forward(i), i);
+			previous->set_forward(inserted, i);
 		}
 
 		modify_lock.unlock();
 		increase_top_level_hint();
+		count_added(top_level + 1);
 
+		if (added) {
+			*added = true;
+		}
+		return true;
+	}
+
+	// An expired entry counts as absent, so adding to it succeeds and
+	// updating it fails. Reviving one still reports a replacement rather
+	// than an add: the node was already counted in size, and callers that
+	// keep their own counts, like sharded_map, would count it twice.
+	static bool write_existing(
+		node* current,
+		Value& value,
+		int64_t expires_at,
+		bool add_if_no_exist,
+		bool update_if_exist)
+	{
+		const bool expired = current->expired();
+		if (expired ? !add_if_no_exist : !update_if_exist) {
+			return false;
+		}
+
+		current->set_value(std::move(value));
+		current->set_expiry(expires_at);
 		return true;
 	}
 
-	template<int ArraySize>
+	template<size_t ArraySize>
 	node* search(
 		const Key& search_key,
 		int top_level,
-		std::array<node*, ArraySize>* update)
+		std::array<node*, ArraySize>* update,
+		std::array<uint64_t, ArraySize>* versions)
 	{
 		node* previous = _head;
 		for (int i = top_level; i >= BOTTOM_LEVEL; --i)
 		{
+			// The version is read before the pointer it vouches for.
+			auto version = previous->version(i);
 			auto current = previous->forward(i);
 			while (compare_less(current, search_key))
 			{
 				previous = current;
+				version = previous->version(i);
 				current = previous->forward(i);
 			}
 			update->at(i) = previous;
+			versions->at(i) = version;
 		}
 		return previous;
 	}
 
+	// Locks level of *current_ptr, the predecessor found by search. If the
+	// level is still at the version the search saw, the forward pointer the
+	// search followed is unchanged and needs no re-walk; otherwise the lock
+	// is dropped and find_and_lock walks to the right node.
+	transferable_lock lock_predecessor(
+		node** current_ptr,
+		uint64_t version,
+		const Key& search_key,
+		int level)
+	{
+		auto lock = lock_counted(*current_ptr, level);
+		if ((*current_ptr)->version(level) == version) {
+			return lock;
+		}
+
+		if (version != UNSEEN_VERSION) {
+			_contention.fetch_add(1, std::memory_order_relaxed);
+		}
+		lock.unlock();
+		return find_and_lock(current_ptr, search_key, level);
+	}
+
 	transferable_lock find_and_lock(
 		node** current_ptr,
 		const Key& search_key,
@@ -308,14 +1183,16 @@ private:
 			next = current->forward(level);
 		}
 
-		auto current_lock = current->lock(level);
+		auto current_lock = lock_counted(current, level);
 		next = current->forward(level);
 
+		// Another writer got in between the unlocked walk and the lock.
 		while (compare_less(next, search_key))
 		{
+			_contention.fetch_add(1, std::memory_order_relaxed);
 			current_lock.unlock();
 			current = next;
-			current_lock = current->lock(level);
+			current_lock = lock_counted(current, level);
 			next = current->forward(level);
 		}
 
@@ -323,6 +1200,51 @@ private:
 		return current_lock;
 	}
 
+	transferable_lock lock_counted(node* current, int level)
+	{
+		auto lock = current->try_lock(level);
+		if (!lock.owns_lock())
+		{
+			_contention.fetch_add(1, std::memory_order_relaxed);
+			lock.lock();
+		}
+		return lock;
+	}
+
+	counter_stripe& local_counters()
+	{
+		thread_local const size_t stripe = std::hash<std::thread::id>()(std::this_thread::get_id());
+		return _counters[stripe % COUNTER_STRIPES];
+	}
+
+	void count_added(int levels)
+	{
+		auto& stripe = local_counters();
+		stripe.size.fetch_add(1, std::memory_order_relaxed);
+		stripe.nodes.fetch_add(1, std::memory_order_relaxed);
+		stripe.links.fetch_add(levels, std::memory_order_relaxed);
+	}
+
+	// Nodes a try_get_value for key would visit.
+	size_t search_path_length(const Key& key) const
+	{
+		const node* current = _head;
+		size_t visited = 0;
+
+		for (int i = _top_level_hint; i >= BOTTOM_LEVEL; --i)
+		{
+			const node* next = current->forward(i);
+			++visited;
+			while (compare_less(next, key))
+			{
+				current = next;
+				next = current->forward(i);
+				++visited;
+			}
+		}
+		return visited;
+	}
+
 	void increase_top_level_hint()
 	{
 		if (_top_level_hint < LEVEL_CAP
@@ -404,7 +1326,7 @@ private:
 
 	bool compare_equal(const node* a, const node* b) const
 	{
-		compare(a, b) == 0;
+		return compare(a, b) == 0;
 	}
 
 	bool compare_greater(const node* a, const Key& search_key) const
@@ -421,8 +1343,6 @@ private:
 	int _top_level_hint = 0;
 	std::mutex _top_level_hint_mutex;
 	top_level_generator top_level_generator;
-
-	static constexpr int BOTTOM_LEVEL = 0;
-	static constexpr int MAX_LEVELS = 32;
-	static constexpr int LEVEL_CAP = MAX_LEVELS - 1;
+	std::atomic<uint64_t> _contention{ 0 };
+	std::array<counter_stripe, COUNTER_STRIPES> _counters;
 };
\ No newline at end of file
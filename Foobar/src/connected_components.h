@@ -0,0 +1,181 @@
+#pragma once
+
+#include "concurrent_disjoint_set.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <vector>
+
+// Labels the connected components of a graph given as an edge list, using
+// every worker of a thread_pool. Edges are unioned in parallel partitions,
+// every vertex is then compressed onto its root, and roots are renumbered
+// densely in vertex order so labels can be used directly as array indices.
+class connected_components
+{
+public:
+	struct result
+	{
+		std::vector<uint32_t> labels;
+		std::vector<size_t> sizes;
+	};
+
+	explicit connected_components(thread_pool& pool)
+		: _pool(pool)
+	{
+	}
+
+	// Edges must be a random-access container of pairs of vertex indices.
+	template<typename Edges>
+	result compute(size_t vertex_count, const Edges& edges)
+	{
+		concurrent_disjoint_set set(vertex_count);
+
+		parallel_for(edges.size(), [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				set.connect(edges[i].first, edges[i].second);
+			}
+		});
+
+		std::vector<uint32_t> roots(vertex_count);
+		parallel_for(vertex_count, [&](size_t begin, size_t end) {
+			for (size_t v = begin; v < end; ++v) {
+				roots[v] = static_cast<uint32_t>(set.find_root(v));
+			}
+		});
+
+		return label(roots);
+	}
+
+private:
+	result label(const std::vector<uint32_t>& roots)
+	{
+		const auto vertex_count = roots.size();
+		const auto partitions = partition_count(vertex_count);
+		const auto partition_size = (vertex_count + partitions - 1) / partitions;
+
+		// Count roots per partition, then prefix-sum the counts so each
+		// partition knows the first dense label it hands out.
+		std::vector<uint32_t> first_label(partitions + 1, 0);
+		parallel_for(vertex_count, [&](size_t begin, size_t end) {
+			uint32_t count = 0;
+			for (size_t v = begin; v < end; ++v) {
+				count += roots[v] == v;
+			}
+			first_label[begin / partition_size + 1] = count;
+		});
+
+		for (size_t i = 1; i <= partitions; ++i) {
+			first_label[i] += first_label[i - 1];
+		}
+
+		result components;
+		components.labels.resize(vertex_count);
+		components.sizes.resize(first_label[partitions]);
+
+		parallel_for(vertex_count, [&](size_t begin, size_t end) {
+			auto next_label = first_label[begin / partition_size];
+			for (size_t v = begin; v < end; ++v)
+			{
+				if (roots[v] == v) {
+					components.labels[v] = next_label++;
+				}
+			}
+		});
+
+		parallel_for(vertex_count, [&](size_t begin, size_t end) {
+			for (size_t v = begin; v < end; ++v)
+			{
+				if (roots[v] != v) {
+					components.labels[v] = components.labels[roots[v]];
+				}
+			}
+
+			// Neighbouring vertices usually share a component, so add runs of
+			// equal labels at once instead of one atomic add per vertex.
+			size_t v = begin;
+			while (v < end)
+			{
+				const auto current = components.labels[v];
+				const auto run_begin = v;
+				while (v < end && components.labels[v] == current) {
+					++v;
+				}
+				std::atomic_ref<size_t>(components.sizes[current]).fetch_add(v - run_begin, std::memory_order_relaxed);
+			}
+		});
+
+		return components;
+	}
+
+	// Splits [0, count) into partition_count(count) contiguous ranges of equal
+	// size and runs body(begin, end) on each of them in the pool. The calling
+	// thread helps run pending tasks while it waits, so it is safe to call
+	// from inside a pool task.
+	template<typename Function>
+	void parallel_for(size_t count, Function body)
+	{
+		if (count == 0) {
+			return;
+		}
+
+		const auto partitions = partition_count(count);
+		const auto partition_size = (count + partitions - 1) / partitions;
+
+		std::vector<std::future<void>> futures;
+		futures.reserve(partitions);
+
+		std::exception_ptr error;
+		try
+		{
+			for (size_t begin = 0; begin < count; begin += partition_size)
+			{
+				const auto end = std::min(begin + partition_size, count);
+				futures.push_back(_pool.submit([&body, begin, end] { body(begin, end); }));
+			}
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+
+		// Every task refers to body and to what it captures on the caller's
+		// stack, so all of them must finish before the first exception is
+		// rethrown.
+		for (auto& future : futures)
+		{
+			while (future.wait_for(std::chrono::seconds::zero()) != std::future_status::ready) {
+				_pool.run_pending_task();
+			}
+
+			try
+			{
+				future.get();
+			}
+			catch (...)
+			{
+				if (!error) {
+					error = std::current_exception();
+				}
+			}
+		}
+
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	size_t partition_count(size_t count) const
+	{
+		const auto partitions = std::max<size_t>(1, _pool.thread_count() * PARTITIONS_PER_THREAD);
+		return std::max<size_t>(1, std::min(partitions, count));
+	}
+
+	thread_pool& _pool;
+
+	static constexpr size_t PARTITIONS_PER_THREAD = 4;
+};
@@ -1,43 +1,245 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-template<size_t N>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Index is the integer type used for element indices and sizes. A 32-bit
+// Index halves the footprint of the set and packs the parent and size of an
+// element into 8 bytes, so a node never straddles a cache line and one find
+// step touches exactly one line.
+template<size_t N, typename Index = size_t>
 class disjoint_set
 {
+	static_assert(N <= std::numeric_limits<Index>::max(), "Index is too narrow for N");
+	static_assert(std::is_trivially_copyable_v<Index>, "Index must be trivially copyable");
+
+	struct node
+	{
+		Index parent;
+		Index size;
+	};
+
+	struct snapshot_header
+	{
+		uint64_t magic;
+		uint32_t version;
+		uint32_t index_size;
+		uint64_t element_count;
+		uint64_t state_size;
+	};
+
+	// The whole set is one trivially copyable block so that its in-memory
+	// layout is also its snapshot file format. The member links are only
+	// read by connect and for_each_member, so they live in their own array
+	// rather than widening the nodes that every find walks.
+	struct state
+	{
+		snapshot_header header;
+		Index component_count;
+		Index largest_root;
+		std::array<node, N> nodes;
+		std::array<Index, N> next;
+	};
+
 public:
 	disjoint_set()
+		: _state(new state, [](state* s) { delete s; })
 	{
+		_state->header = expected_header();
+		_state->component_count = N;
+		_state->largest_root = 0;
 		for (size_t i = 0; i < N; ++i) {
-			_parent[i] = i;
+			_state->nodes[i] = { static_cast<Index>(i), 1 };
+			_state->next[i] = static_cast<Index>(i);
 		}
-		for (size_t i = 0; i < N; ++i) {
-			_size[i] = 1;
+	}
+
+	// Adopts a snapshot previously written by save() that the caller has
+	// already placed in memory, typically by mapping the file. Nothing is
+	// copied, and release is called when the set no longer needs the memory.
+	// Only the size and header are checked, so the rest of the snapshot is
+	// not read until finds touch it; call validate() before using one that
+	// may be corrupt.
+	disjoint_set(void* memory, size_t size, std::function<void()> release)
+		: _state(static_cast<state*>(memory), [release](state*) { if (release) release(); })
+	{
+		const auto header = expected_header();
+		if (memory == nullptr || size != sizeof(state) || std::memcmp(&_state->header, &header, sizeof(header)) != 0) {
+			throw std::invalid_argument("memory does not hold a compatible disjoint_set snapshot");
+		}
+	}
+
+	// A moved-from set may only be assigned to or destroyed.
+	disjoint_set(disjoint_set&&) = default;
+	disjoint_set& operator=(disjoint_set&&) = default;
+
+	// Checks that the set is well formed: every index is in range, every
+	// parent chain ends at a root, the member lists are cycles that match
+	// the component sizes, and the counts agree. Reads the whole set, so it
+	// is meant for snapshots from an untrusted source, on which finds and
+	// for_each_member could otherwise run out of range or never finish.
+	bool validate() const
+	{
+		const auto& s = live();
+		if (s.component_count > N || (N > 0 && s.largest_root >= N)) {
+			return false;
+		}
+
+		for (size_t i = 0; i < N; ++i)
+		{
+			if (s.nodes[i].parent >= N || s.next[i] >= N) {
+				return false;
+			}
+		}
+
+		// Each parent chain must reach a root without revisiting an element.
+		enum : uint8_t { UNSEEN, ON_PATH, DONE };
+		std::vector<uint8_t> marks(N, UNSEEN);
+		std::vector<Index> roots(N);
+		for (size_t i = 0; i < N; ++i)
+		{
+			Index a = static_cast<Index>(i);
+			while (marks[a] == UNSEEN && s.nodes[a].parent != a)
+			{
+				marks[a] = ON_PATH;
+				a = s.nodes[a].parent;
+			}
+			if (marks[a] == ON_PATH) {
+				return false;
+			}
+
+			const Index root = marks[a] == DONE ? roots[a] : a;
+			for (Index b = static_cast<Index>(i); marks[b] != DONE; b = s.nodes[b].parent)
+			{
+				marks[b] = DONE;
+				roots[b] = root;
+			}
 		}
+
+		size_t component_count = 0;
+		size_t total_size = 0;
+		for (size_t i = 0; i < N; ++i)
+		{
+			if (roots[i] == i)
+			{
+				++component_count;
+				total_size += s.nodes[i].size;
+			}
+		}
+		if (component_count != s.component_count || total_size != N) {
+			return false;
+		}
+
+		// Each member list must be one cycle through exactly the elements of
+		// its component.
+		std::fill(marks.begin(), marks.end(), UNSEEN);
+		for (size_t i = 0; i < N; ++i)
+		{
+			if (marks[i] != UNSEEN) {
+				continue;
+			}
+
+			const Index root = roots[i];
+			size_t length = 0;
+			Index member = static_cast<Index>(i);
+			do
+			{
+				if (marks[member] != UNSEEN || roots[member] != root) {
+					return false;
+				}
+				marks[member] = DONE;
+				++length;
+				member = s.next[member];
+			} while (member != i);
+
+			if (length != s.nodes[root].size) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Writes the state as one flat block that can later be mapped straight
+	// back in. The data reaches the disk before the file is renamed over the
+	// old snapshot, and on POSIX the directory is synced after, so a crash or
+	// power loss at any point leaves either the old snapshot or the new one.
+	bool save(const std::string& path) const
+	{
+		const auto temp_path = path + ".tmp";
+		std::FILE* file = std::fopen(temp_path.c_str(), "wb");
+		if (!file) {
+			return false;
+		}
+
+		const bool written = std::fwrite(&live(), sizeof(state), 1, file) == 1
+			&& std::fflush(file) == 0
+			&& sync_file(file);
+		if (std::fclose(file) != 0 || !written)
+		{
+			std::remove(temp_path.c_str());
+			return false;
+		}
+
+		std::error_code error;
+		std::filesystem::rename(temp_path, path, error);
+		return !error && sync_parent_directory(path);
 	}
 
+	// Elements are taken as size_t and checked against N before they are
+	// narrowed to Index, so an out-of-range argument cannot wrap onto a
+	// valid element.
 	bool connect(size_t a, size_t b)
 	{
 		if (a >= N || b >= N) {
 			return false;
 		}
 
-		size_t root_a = find_root(a);
-		size_t root_b = find_root(b);
+		Index root_a = find_root(static_cast<Index>(a));
+		Index root_b = find_root(static_cast<Index>(b));
 
 		if (root_a == root_b) {
 			return false;
 		}
 
-		if (_size[root_a] < _size[root_b])
-		{
-			_parent[root_a] = root_b;
-			_size[root_b] += _size[root_b];
+		if (live().nodes[root_a].size < live().nodes[root_b].size) {
+			std::swap(root_a, root_b);
 		}
-		else
-		{
-			_parent[root_b] = root_a;
-			_size[root_a] += _size[root_b];
+
+		live().nodes[root_b].parent = root_a;
+		live().nodes[root_a].size += live().nodes[root_b].size;
+
+		// Splicing two circular lists is a swap of one successor from each.
+		std::swap(live().next[root_a], live().next[root_b]);
+
+		--live().component_count;
+		if (live().nodes[root_a].size > live().nodes[live().largest_root].size) {
+			live().largest_root = root_a;
 		}
 
 		return true;
@@ -45,20 +247,151 @@ public:
 
 	bool is_connected(size_t a, size_t b)
 	{
-		return find_root(a) == find_root(b);
+		return a < N && b < N && find_root(static_cast<Index>(a)) == find_root(static_cast<Index>(b));
+	}
+
+	Index find(size_t a)
+	{
+		return find_root(checked(a));
+	}
+
+	Index component_size(size_t a)
+	{
+		return live().nodes[find_root(checked(a))].size;
+	}
+
+	Index component_count() const
+	{
+		return live().component_count;
+	}
+
+	// Returns the root of the largest component. Components only grow, so
+	// this is tracked on every connect rather than searched for.
+	Index largest_component()
+	{
+		if constexpr (N == 0) {
+			throw std::logic_error("disjoint_set has no elements");
+		}
+		return find_root(live().largest_root);
+	}
+
+	// Calls f(member) for every element in the same component as a, a
+	// included, in time proportional to the size of the component.
+	template<typename Function>
+	void for_each_member(size_t a, Function f) const
+	{
+		const Index first = checked(a);
+		Index member = first;
+		do
+		{
+			f(member);
+			member = live().next[member];
+		} while (member != first);
+	}
+
+	// Writes the root of each of the count elements to roots. Elements a few
+	// positions ahead are prefetched so their cache misses overlap with the
+	// current find instead of being paid one after another.
+	void find(const Index* elements, size_t count, Index* roots)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (i + PREFETCH_DISTANCE < count) {
+				prefetch(&live().nodes[std::min<size_t>(elements[i + PREFETCH_DISTANCE], N - 1)]);
+			}
+			roots[i] = find(elements[i]);
+		}
+	}
+
+	static constexpr size_t snapshot_size()
+	{
+		return sizeof(state);
 	}
 
 private:
-	size_t find_root(size_t a)
+	Index find_root(Index a)
 	{
-		if (a == _parent[a]) {
-			return a;
+		// Path halving: every other node on the path is pointed at its
+		// grandparent, so no recursion and no second pass are needed.
+		while (live().nodes[a].parent != a)
+		{
+			live().nodes[a].parent = live().nodes[live().nodes[a].parent].parent;
+			a = live().nodes[a].parent;
 		}
 
-		_parent[a] = find_root(_parent[a]);
-		return _parent[a];
+		return a;
 	}
 
-	std::array<size_t, N> _parent;
-	std::array<size_t, N> _size;
+	static bool sync_file(std::FILE* file)
+	{
+#if defined(_WIN32)
+		return _commit(_fileno(file)) == 0;
+#else
+		return fsync(fileno(file)) == 0;
+#endif
+	}
+
+	// A rename is durable on POSIX only once its directory is synced.
+	// Windows cannot sync a directory and leaves this to the file system.
+	static bool sync_parent_directory(const std::string& path)
+	{
+#if defined(_WIN32)
+		(void)path;
+		return true;
+#else
+		auto directory = std::filesystem::path(path).parent_path();
+		if (directory.empty()) {
+			directory = ".";
+		}
+
+		const int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			return false;
+		}
+		const bool synced = fsync(fd) == 0;
+		close(fd);
+		return synced;
+#endif
+	}
+
+	// Using a moved-from set is a precondition violation.
+	state& live() const
+	{
+		assert(_state && "disjoint_set used after being moved from");
+		return *_state;
+	}
+
+	static Index checked(size_t a)
+	{
+		if (a >= N) {
+			throw std::out_of_range("disjoint_set element out of range");
+		}
+		return static_cast<Index>(a);
+	}
+
+	static snapshot_header expected_header()
+	{
+		snapshot_header header{};
+		header.magic = SNAPSHOT_MAGIC;
+		header.version = SNAPSHOT_VERSION;
+		header.index_size = sizeof(Index);
+		header.element_count = N;
+		header.state_size = sizeof(state);
+		return header;
+	}
+
+	static void prefetch(const void* address)
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+		__builtin_prefetch(address);
+#endif
+	}
+
+	std::unique_ptr<state, std::function<void(state*)>> _state;
+
+	static constexpr size_t PREFETCH_DISTANCE = 8;
+	static constexpr uint64_t SNAPSHOT_MAGIC = 0x746e696f6a736964; // "disjoint"
+	static constexpr uint32_t SNAPSHOT_VERSION = 2;
 };
\ No newline at end of file
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Epoch-based reclamation for lock-free readers. A thread holds a guard
+// while it may be looking at shared nodes; a node that has been unlinked is
+// handed to retire() and freed only once every thread that might still see
+// it has dropped its guard. Pinning costs a store and a fence, with no lock
+// and no write to memory shared with other threads.
+//
+// There is one domain per process. Guards nest and must be released on the
+// thread that took them.
+class epoch_reclaimer
+{
+	struct retired
+	{
+		uint64_t epoch;
+		void* pointer;
+		void (*deleter)(void*);
+	};
+
+	struct alignas(64) record
+	{
+		// The epoch the thread pinned, or zero while it holds no guard.
+		std::atomic<uint64_t> epoch{ 0 };
+		std::atomic<bool> in_use{ true };
+		record* next = nullptr;
+		// Nodes the thread retired. They stay here when the thread exits,
+		// so the record's next owner or collect_all frees them. Only
+		// collect_all contends for the mutex.
+		std::mutex garbage_mutex;
+		std::vector<retired> garbage;
+	};
+
+	struct thread_state
+	{
+		~thread_state()
+		{
+			if (slot)
+			{
+				slot->epoch.store(0, std::memory_order_release);
+				collect_all();
+				slot->in_use.store(false, std::memory_order_release);
+			}
+		}
+
+		record* slot = nullptr;
+		unsigned nesting = 0;
+	};
+
+public:
+	class guard
+	{
+	public:
+		guard() = default;
+
+		guard(const guard& other)
+			: _pinned(other._pinned)
+		{
+			if (_pinned) {
+				pin_current_thread();
+			}
+		}
+
+		guard(guard&& other) noexcept
+			: _pinned(std::exchange(other._pinned, false))
+		{
+		}
+
+		guard& operator=(guard other) noexcept
+		{
+			std::swap(_pinned, other._pinned);
+			return *this;
+		}
+
+		~guard()
+		{
+			if (_pinned) {
+				unpin_current_thread();
+			}
+		}
+
+	private:
+		friend class epoch_reclaimer;
+
+		explicit guard(bool pinned)
+			: _pinned(pinned)
+		{
+		}
+
+		bool _pinned = false;
+	};
+
+	static guard pin()
+	{
+		pin_current_thread();
+		return guard(true);
+	}
+
+	// Frees pointer with deleter once no thread that could have reached it
+	// still holds a guard. The caller must already have unlinked it.
+	static void retire(void* pointer, void (*deleter)(void*))
+	{
+		record* slot = local_slot();
+		size_t pending;
+		{
+			std::scoped_lock<std::mutex> lock(slot->garbage_mutex);
+			slot->garbage.push_back({ global_epoch().load(std::memory_order_acquire), pointer, deleter });
+			pending = slot->garbage.size();
+		}
+
+		if (pending >= COLLECT_THRESHOLD)
+		{
+			try_advance();
+			free_reclaimable(slot);
+		}
+	}
+
+	template<typename T>
+	static void retire(T* pointer)
+	{
+		retire(pointer, [](void* p) { delete static_cast<T*>(p); });
+	}
+
+	// Frees everything retired by any thread, live or exited, that no guard
+	// can still reach. With no guard held anywhere that is everything.
+	// Containers call it on destruction, and each thread on exit, so a
+	// quiescent process holds no retired nodes.
+	static void collect_all()
+	{
+		// Two advances past the newest retirement make it reclaimable; a
+		// third covers an advance that raced with the first.
+		for (int i = 0; i < 3; ++i) {
+			try_advance();
+		}
+
+		for (record* r = records().load(std::memory_order_acquire); r; r = r->next) {
+			free_reclaimable(r);
+		}
+	}
+
+private:
+	static void pin_current_thread()
+	{
+		auto& state = local();
+		if (state.nesting++ != 0) {
+			return;
+		}
+
+		record* slot = local_slot();
+		slot->epoch.store(global_epoch().load(std::memory_order_relaxed), std::memory_order_relaxed);
+		// Orders the announcement before any read of shared nodes.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	static void unpin_current_thread()
+	{
+		auto& state = local();
+		if (--state.nesting == 0) {
+			state.slot->epoch.store(0, std::memory_order_release);
+		}
+	}
+
+	// Anything retired two epochs before the current one is unreachable.
+	// The deleters run outside the record's lock, as freeing a node may
+	// destroy a container that collects in turn.
+	static void free_reclaimable(record* r)
+	{
+		std::vector<retired> reclaimable;
+		{
+			std::scoped_lock<std::mutex> lock(r->garbage_mutex);
+			const uint64_t epoch = global_epoch().load(std::memory_order_acquire);
+			auto keep = r->garbage.begin();
+			for (auto& item : r->garbage)
+			{
+				if (item.epoch + 2 <= epoch) {
+					reclaimable.push_back(item);
+				}
+				else {
+					*keep++ = item;
+				}
+			}
+			r->garbage.erase(keep, r->garbage.end());
+		}
+
+		for (auto& item : reclaimable) {
+			item.deleter(item.pointer);
+		}
+	}
+
+	// The epoch can move on once every pinned thread has seen the current
+	// one.
+	static void try_advance()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		uint64_t epoch = global_epoch().load(std::memory_order_acquire);
+		for (record* r = records().load(std::memory_order_acquire); r; r = r->next)
+		{
+			const uint64_t pinned = r->epoch.load(std::memory_order_acquire);
+			if (pinned != 0 && pinned != epoch) {
+				return;
+			}
+		}
+
+		global_epoch().compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+	}
+
+	// Records are reused after their thread exits and never freed.
+	static record* acquire_record()
+	{
+		for (record* r = records().load(std::memory_order_acquire); r; r = r->next)
+		{
+			bool free = false;
+			if (!r->in_use.load(std::memory_order_relaxed)
+				&& r->in_use.compare_exchange_strong(free, true, std::memory_order_acquire)) {
+				return r;
+			}
+		}
+
+		auto* r = new record();
+		r->next = records().load(std::memory_order_relaxed);
+		while (!records().compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed)) {
+		}
+		return r;
+	}
+
+	static thread_state& local()
+	{
+		thread_local thread_state state;
+		return state;
+	}
+
+	static record* local_slot()
+	{
+		auto& state = local();
+		if (!state.slot) {
+			state.slot = acquire_record();
+		}
+		return state.slot;
+	}
+
+	static std::atomic<uint64_t>& global_epoch()
+	{
+		static std::atomic<uint64_t> epoch{ 1 };
+		return epoch;
+	}
+
+	static std::atomic<record*>& records()
+	{
+		static std::atomic<record*> head{ nullptr };
+		return head;
+	}
+
+	static constexpr size_t COLLECT_THRESHOLD = 64;
+};
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "stopwatch.h"
+#include "tsc_clock.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Log-linear histogram of latencies in nanoseconds. Every power of two is
+// split into SUB_BUCKETS equal buckets, so any recorded value is reported
+// with a relative error below 1 / SUB_BUCKETS while the whole 64-bit range
+// fits in a few thousand counters.
+class latency_histogram
+{
+public:
+	static constexpr int SUB_BUCKET_BITS = 5;
+	static constexpr uint64_t SUB_BUCKETS = 1ULL << SUB_BUCKET_BITS;
+	static constexpr size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+	latency_histogram()
+	{
+		reset();
+	}
+
+	void record(uint64_t nanoseconds, uint64_t count = 1)
+	{
+		_counts[bucket_index(nanoseconds)] += count;
+		_total_count += count;
+		_min = std::min(_min, nanoseconds);
+		_max = std::max(_max, nanoseconds);
+	}
+
+	void merge(const latency_histogram& other)
+	{
+		for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+			_counts[i] += other._counts[i];
+		}
+		_total_count += other._total_count;
+		_min = std::min(_min, other._min);
+		_max = std::max(_max, other._max);
+	}
+
+	void reset()
+	{
+		_counts.fill(0);
+		_total_count = 0;
+		_min = UINT64_MAX;
+		_max = 0;
+	}
+
+	// Returns the value at or below which the given fraction (0 to 1) of all
+	// samples fall, reported as the upper bound of the bucket it lands in.
+	uint64_t percentile(double fraction) const
+	{
+		if (_total_count == 0) {
+			return 0;
+		}
+
+		const auto clamped = std::clamp(fraction, 0.0, 1.0);
+		const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(clamped * _total_count + 0.5));
+
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKET_COUNT; ++i)
+		{
+			seen += _counts[i];
+			if (seen >= rank) {
+				return std::clamp(bucket_upper_bound(i), _min, _max);
+			}
+		}
+
+		return _max;
+	}
+
+	uint64_t p50() const { return percentile(0.5); }
+	uint64_t p99() const { return percentile(0.99); }
+	uint64_t p999() const { return percentile(0.999); }
+	uint64_t min() const { return _total_count ? _min : 0; }
+	uint64_t max() const { return _max; }
+	uint64_t count() const { return _total_count; }
+
+	static size_t bucket_index(uint64_t value)
+	{
+		if (value < SUB_BUCKETS) {
+			return static_cast<size_t>(value);
+		}
+
+		// The top SUB_BUCKET_BITS + 1 significant bits select the bucket; the
+		// leading one is implied by the power of two.
+		const int shift = std::bit_width(value) - 1 - SUB_BUCKET_BITS;
+		const auto sub_bucket = (value >> shift) & (SUB_BUCKETS - 1);
+		return static_cast<size_t>((shift + 1) * SUB_BUCKETS + sub_bucket);
+	}
+
+	static uint64_t bucket_upper_bound(size_t index)
+	{
+		if (index < SUB_BUCKETS) {
+			return index;
+		}
+
+		const auto shift = index / SUB_BUCKETS - 1;
+		const auto sub_bucket = index % SUB_BUCKETS;
+		const auto lower_bound = (SUB_BUCKETS + sub_bucket) << shift;
+		return lower_bound + ((1ULL << shift) - 1);
+	}
+
+private:
+	friend class latency_recorder;
+
+	std::array<uint64_t, BUCKET_COUNT> _counts;
+	uint64_t _total_count;
+	uint64_t _min;
+	uint64_t _max;
+};
+
+// Records latencies from any number of threads without locks or allocation
+// on the hot path. Each thread writes to its own set of counters, created the
+// first time that thread records; snapshot() sums them into a histogram.
+class latency_recorder
+{
+	struct shard
+	{
+		explicit shard(std::thread::id owner)
+			: owner(owner)
+		{
+		}
+
+		// Only the owner writes. A thread id reused after its thread exits
+		// inherits the shard, which keeps the single writer.
+		const std::thread::id owner;
+		std::array<std::atomic<uint64_t>, latency_histogram::BUCKET_COUNT> counts{};
+		std::atomic<uint64_t> min{ UINT64_MAX };
+		std::atomic<uint64_t> max{ 0 };
+	};
+
+public:
+	latency_recorder()
+		: _id(s_next_id.fetch_add(1, std::memory_order_relaxed))
+	{
+	}
+
+	latency_recorder(const latency_recorder&) = delete;
+	latency_recorder& operator=(const latency_recorder&) = delete;
+
+	void record(uint64_t nanoseconds)
+	{
+		auto& shard = local_shard();
+
+		// Only the owning thread writes to a shard, so plain load/store pairs
+		// suffice and no read-modify-write is needed.
+		auto& counter = shard.counts[latency_histogram::bucket_index(nanoseconds)];
+		counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+		if (nanoseconds < shard.min.load(std::memory_order_relaxed)) {
+			shard.min.store(nanoseconds, std::memory_order_relaxed);
+		}
+		if (nanoseconds > shard.max.load(std::memory_order_relaxed)) {
+			shard.max.store(nanoseconds, std::memory_order_relaxed);
+		}
+	}
+
+	latency_histogram snapshot() const
+	{
+		latency_histogram histogram;
+
+		std::scoped_lock<std::mutex> lock(_shards_mutex);
+		for (const auto& shard : _shards)
+		{
+			for (size_t i = 0; i < latency_histogram::BUCKET_COUNT; ++i)
+			{
+				const auto count = shard->counts[i].load(std::memory_order_relaxed);
+				histogram._counts[i] += count;
+				histogram._total_count += count;
+			}
+			histogram._min = std::min(histogram._min, shard->min.load(std::memory_order_relaxed));
+			histogram._max = std::max(histogram._max, shard->max.load(std::memory_order_relaxed));
+		}
+
+		return histogram;
+	}
+
+private:
+	shard& local_shard()
+	{
+		// Each thread caches the shards it owns, keyed by recorder id and
+		// kept in most recently used order. Ids are never reused, so a stale
+		// entry for a destroyed recorder is harmless and ages out.
+		thread_local std::vector<std::pair<uint64_t, shard*>> t_shards;
+
+		const auto hit = std::find_if(t_shards.begin(), t_shards.end(), [this](const auto& entry) { return entry.first == _id; });
+		if (hit != t_shards.end())
+		{
+			std::rotate(t_shards.begin(), hit, hit + 1);
+			return *t_shards.front().second;
+		}
+
+		if (t_shards.size() >= MAX_CACHED_SHARDS) {
+			t_shards.pop_back();
+		}
+
+		auto* result = find_or_add_shard(std::this_thread::get_id());
+		t_shards.emplace(t_shards.begin(), _id, result);
+		return *result;
+	}
+
+	// A thread that fell out of its cache finds its own shard again, so
+	// each thread allocates at most one shard per recorder.
+	shard* find_or_add_shard(std::thread::id owner)
+	{
+		std::scoped_lock<std::mutex> lock(_shards_mutex);
+		for (const auto& shard : _shards)
+		{
+			if (shard->owner == owner) {
+				return shard.get();
+			}
+		}
+
+		_shards.push_back(std::make_unique<shard>(owner));
+		return _shards.back().get();
+	}
+
+	const uint64_t _id;
+	mutable std::mutex _shards_mutex;
+	std::vector<std::unique_ptr<shard>> _shards;
+
+	static constexpr size_t MAX_CACHED_SHARDS = 16;
+	static inline std::atomic<uint64_t> s_next_id{ 1 };
+};
+
+// Records the lifetime of the scope it is declared in, timed with tsc_clock
+// so the measurement adds only a few cycles to the scope.
+class scoped_latency_timer
+{
+public:
+	explicit scoped_latency_timer(latency_recorder& recorder)
+		: _recorder(recorder)
+	{
+		_stopwatch.start();
+	}
+
+	scoped_latency_timer(const scoped_latency_timer&) = delete;
+	scoped_latency_timer& operator=(const scoped_latency_timer&) = delete;
+
+	~scoped_latency_timer()
+	{
+		_recorder.record(static_cast<uint64_t>(_stopwatch.elapsed_nanoseconds()));
+	}
+
+private:
+	latency_recorder& _recorder;
+	basic_stopwatch<tsc_clock> _stopwatch;
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "../disjoint_set.h"
+#include "mapped_file.h"
+
+// Opens a snapshot written by disjoint_set::save() without reading it: the
+// set works directly on the mapped file, and only the pages that finds and
+// connects touch are ever loaded. With MapMode::CopyOnWrite the process can
+// keep connecting without altering the snapshot; with MapMode::Shared every
+// change is written back to it.
+template<size_t N, typename Index = size_t>
+disjoint_set<N, Index> map_disjoint_set(const std::string& path, MapMode::Value mode)
+{
+    auto file = std::make_shared<MappedFile>(path, mode);
+    return disjoint_set<N, Index>(file->data(), file->size(), [file] {});
+}
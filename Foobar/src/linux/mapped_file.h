@@ -0,0 +1,103 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include "fd_flags.h"
+
+struct MapMode
+{
+    enum Value
+    {
+        // Writes go to private copies of the touched pages; the file is
+        // never modified.
+        CopyOnWrite,
+        // Writes go straight to the page cache and end up in the file.
+        Shared,
+    };
+};
+
+// Maps a whole existing file into memory. Pages are faulted in on first
+// access, so opening is O(1) regardless of the file size.
+class MappedFile
+{
+public:
+    MappedFile(const std::string& path, MapMode::Value mode)
+        : path_(path), data_(nullptr), size_(0)
+    {
+        const int flags = mode == MapMode::Shared ? OpenFlags::ReadWrite : OpenFlags::ReadOnly;
+        const int fd = open(path.c_str(), flags | O_CLOEXEC);
+        if (fd == -1) {
+            throw_error("open()");
+        }
+
+        struct stat status;
+        if (fstat(fd, &status) == -1) {
+            const int error = errno;
+            close(fd);
+            errno = error;
+            throw_error("fstat()");
+        }
+
+        size_ = static_cast<size_t>(status.st_size);
+        if (size_ > 0)
+        {
+            const int sharing = mode == MapMode::Shared ? MAP_SHARED : MAP_PRIVATE;
+            data_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, sharing, fd, 0);
+        }
+
+        // The mapping keeps its own reference to the file.
+        const int error = errno;
+        close(fd);
+
+        if (data_ == MAP_FAILED) {
+            data_ = nullptr;
+            errno = error;
+            throw_error("mmap()");
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other)
+        : path_(std::move(other.path_))
+        , data_(std::exchange(other.data_, nullptr))
+        , size_(std::exchange(other.size_, 0))
+    {
+    }
+
+    ~MappedFile()
+    {
+        if (data_) {
+            munmap(data_, size_);
+        }
+    }
+
+    void* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // Writes dirty pages of a shared mapping back to the file.
+    void flush()
+    {
+        if (data_ && msync(data_, size_, MS_SYNC) == -1) {
+            throw_error("msync()");
+        }
+    }
+
+private:
+    [[noreturn]] void throw_error(const std::string& msg)
+    {
+        throw std::system_error(errno, std::generic_category(), path_ + ": " + msg);
+    }
+
+    std::string path_;
+    void* data_;
+    size_t size_;
+};
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "semaphore.h"
+#include "shared_memory.h"
+
+namespace ipc
+{
+// A bounded message ring in shared memory for many producers and a single
+// consumer (or a single producer). Messages are written and read in place in
+// their slot, so nothing is copied between processes. Claiming and
+// publishing slots are lock-free; the two semaphores are only touched when
+// the consumer finds the ring empty or a producer finds it full.
+//
+// The creating process owns the channel's name. A process that opens the
+// channel while it is still being created waits up to
+// SharedMemory::OPEN_TIMEOUT for the creator to publish it.
+class RingChannel
+{
+    struct Header
+    {
+        uint64_t magic;
+        uint32_t slot_count;
+        uint32_t slot_size;
+        uint64_t slot_stride;
+        alignas(64) std::atomic<uint64_t> write_position;
+        alignas(64) std::atomic<uint64_t> read_position;
+        alignas(64) std::atomic<uint32_t> consumer_waiting;
+        std::atomic<uint32_t> producers_waiting;
+    };
+
+    // A slot is free for writing at position p when its sequence is p and
+    // holds a message for reading when its sequence is p + 1.
+    struct SlotHeader
+    {
+        std::atomic<uint64_t> sequence;
+        uint32_t length;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock-free");
+
+public:
+    // A claimed slot. data points into shared memory and stays valid until the
+    // slot is handed back with end_write or end_read.
+    struct Slot
+    {
+        void* data;
+        size_t capacity;
+        size_t length;
+        uint64_t position;
+    };
+
+    // Creates a channel of slot_count slots (a power of two, at least 2) that
+    // each hold a message of up to slot_size bytes.
+    RingChannel(const std::string& name, uint32_t slot_count, uint32_t slot_size)
+        : memory_(name, required_size(checked_slot_count(slot_count), slot_size))
+        , readable_(name + ".readable", 0)
+        , writable_(name + ".writable", 0)
+        , header_(new (memory_.data()) Header())
+    {
+        header_->slot_count = slot_count;
+        header_->slot_size = slot_size;
+        header_->slot_stride = stride(slot_size);
+
+        for (uint32_t i = 0; i < slot_count; ++i) {
+            new (slot_header(i)) SlotHeader{ { i }, 0 };
+        }
+
+        std::atomic_ref<uint64_t>(header_->magic).store(MAGIC, std::memory_order_release);
+    }
+
+    // Opens a channel created by another process.
+    RingChannel(const std::string& name)
+        : memory_(SharedMemory::wait_until_sized(name))
+        , readable_(published_name(memory_, name) + ".readable")
+        , writable_(name + ".writable")
+        , header_(static_cast<Header*>(memory_.data()))
+    {
+        if (memory_.size() < required_size(header_->slot_count, header_->slot_size))
+        {
+            throw std::invalid_argument(name + ": not a ring channel");
+        }
+    }
+
+    RingChannel(const RingChannel&) = delete;
+    RingChannel& operator=(const RingChannel&) = delete;
+
+    size_t slot_size() const { return header_->slot_size; }
+
+    // Claims the next free slot for writing, or returns false if the ring is
+    // full. Safe to call from several producers at once.
+    bool try_begin_write(Slot* slot)
+    {
+        auto position = header_->write_position.load(std::memory_order_relaxed);
+        while (true)
+        {
+            auto* header = slot_header(position);
+            const auto sequence = header->sequence.load(std::memory_order_acquire);
+
+            if (sequence == position)
+            {
+                if (header_->write_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    *slot = { payload(header), header_->slot_size, 0, position };
+                    return true;
+                }
+            }
+            else if (sequence < position) {
+                return false;
+            }
+            else {
+                position = header_->write_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Like try_begin_write, but sleeps while the ring is full.
+    void begin_write(Slot* slot)
+    {
+        while (!try_begin_write(slot))
+        {
+            header_->producers_waiting.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (try_begin_write(slot))
+            {
+                // If end_read has already taken the registration it also
+                // released a unit for it, which is absorbed here rather than
+                // left to wake a later producer for nothing.
+                if (!withdraw_waiting()) {
+                    writable_.acquire();
+                }
+                return;
+            }
+
+            writable_.acquire();
+        }
+    }
+
+    // Publishes the first length bytes of a slot claimed with begin_write.
+    // Throws if length exceeds the slot, leaving the slot claimed so that
+    // the caller can still publish it with a valid length.
+    void end_write(const Slot& slot, size_t length)
+    {
+        if (length > header_->slot_size) {
+            throw std::invalid_argument("message is longer than slot_size");
+        }
+
+        auto* header = slot_header(slot.position);
+        header->length = static_cast<uint32_t>(length);
+        header->sequence.store(slot.position + 1, std::memory_order_release);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (header_->consumer_waiting.load(std::memory_order_relaxed)
+            && header_->consumer_waiting.exchange(0, std::memory_order_relaxed)) {
+            readable_.release();
+        }
+    }
+
+    // Returns the oldest message without copying it, or false if the ring is
+    // empty. Only one consumer may read.
+    bool try_begin_read(Slot* slot)
+    {
+        const auto position = header_->read_position.load(std::memory_order_relaxed);
+        auto* header = slot_header(position);
+
+        if (header->sequence.load(std::memory_order_acquire) != position + 1) {
+            return false;
+        }
+
+        *slot = { payload(header), header_->slot_size, header->length, position };
+        return true;
+    }
+
+    // Like try_begin_read, but sleeps while the ring is empty.
+    void begin_read(Slot* slot)
+    {
+        while (!try_begin_read(slot))
+        {
+            header_->consumer_waiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (try_begin_read(slot))
+            {
+                header_->consumer_waiting.store(0, std::memory_order_relaxed);
+                return;
+            }
+
+            readable_.acquire();
+        }
+    }
+
+    // Hands a slot returned by begin_read back to the producers.
+    void end_read(const Slot& slot)
+    {
+        slot_header(slot.position)->sequence.store(slot.position + header_->slot_count, std::memory_order_release);
+        header_->read_position.store(slot.position + 1, std::memory_order_relaxed);
+
+        // Every registered producer is woken once and the registrations are
+        // cleared, so units do not pile up in the semaphore while producers
+        // keep waiting.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (header_->producers_waiting.load(std::memory_order_relaxed) != 0)
+        {
+            const auto waiting = header_->producers_waiting.exchange(0, std::memory_order_relaxed);
+            if (waiting != 0) {
+                writable_.release(waiting);
+            }
+        }
+    }
+
+private:
+    // With a single slot, the sequence that marks it readable at position p
+    // is also the one that marks it free at p + 1, so a second producer
+    // would overwrite an unread message.
+    static uint32_t checked_slot_count(uint32_t slot_count)
+    {
+        if (slot_count < 2 || (slot_count & (slot_count - 1)) != 0) {
+            throw std::invalid_argument("slot_count must be a power of two and at least 2");
+        }
+        return slot_count;
+    }
+
+    // Waits for the creator to publish the header, which it does only after
+    // creating the semaphores, so that they can be opened next. Returns name.
+    static const std::string& published_name(const SharedMemory& memory, const std::string& name)
+    {
+        if (memory.size() < sizeof(Header)) {
+            throw std::invalid_argument(name + ": not a ring channel");
+        }
+
+        auto& magic = static_cast<Header*>(memory.data())->magic;
+        const auto deadline = std::chrono::steady_clock::now() + SharedMemory::OPEN_TIMEOUT;
+        while (std::atomic_ref<uint64_t>(magic).load(std::memory_order_acquire) != MAGIC)
+        {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                throw std::invalid_argument(name + ": not a ring channel");
+            }
+            std::this_thread::sleep_for(SharedMemory::OPEN_POLL_INTERVAL);
+        }
+        return name;
+    }
+
+    // Cancels this producer's registration if it is still counted.
+    bool withdraw_waiting()
+    {
+        auto waiting = header_->producers_waiting.load(std::memory_order_relaxed);
+        while (waiting != 0)
+        {
+            if (header_->producers_waiting.compare_exchange_weak(waiting, waiting - 1, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static size_t stride(uint32_t slot_size)
+    {
+        const size_t unaligned = sizeof(SlotHeader) + slot_size;
+        return (unaligned + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    }
+
+    static size_t required_size(uint32_t slot_count, uint32_t slot_size)
+    {
+        const size_t header = (sizeof(Header) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        return header + static_cast<size_t>(slot_count) * stride(slot_size);
+    }
+
+    SlotHeader* slot_header(uint64_t position) const
+    {
+        const size_t header = (sizeof(Header) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        const size_t index = position & (header_->slot_count - 1);
+        auto* base = static_cast<char*>(memory_.data()) + header;
+        return reinterpret_cast<SlotHeader*>(base + index * header_->slot_stride);
+    }
+
+    static void* payload(SlotHeader* header)
+    {
+        return reinterpret_cast<char*>(header) + sizeof(SlotHeader);
+    }
+
+    SharedMemory memory_;
+    Semaphore readable_;
+    Semaphore writable_;
+    Header* header_;
+
+    static constexpr size_t CACHE_LINE = 64;
+    static constexpr uint64_t MAGIC = 0x6c656e6e61686372; // "rchannel"
+};
+}
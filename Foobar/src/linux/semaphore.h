@@ -1,86 +1,215 @@
-#include <assert.h>
-#include <semaphore.h>
-#include <stdio.h>
-#include <string.h>
+#pragma once
 
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <new>
 #include <string>
+#include <system_error>
+#include <thread>
 
-#include "fd_flags.h"
+#include "shared_memory.h"
 
 namespace ipc
 {
+// A named counting semaphore shared between processes. The count lives in
+// shared memory and is taken with a compare-and-swap, so acquiring an
+// available unit or releasing with nobody waiting costs no system call.
+// Before sleeping on a futex an acquirer spins for a while; the spin budget
+// adapts to how often spinning has paid off recently.
+//
+// A semaphore may be opened while its creator is still setting it up; the
+// opener waits up to SharedMemory::OPEN_TIMEOUT for the creator to size the segment and
+// publish the initialized state.
 class Semaphore
 {
+    struct State
+    {
+        std::atomic<uint32_t> count;
+        std::atomic<uint32_t> waiters;
+        std::atomic<uint32_t> spin_limit;
+        // Set to INITIALIZED, last, by the creator.
+        std::atomic<uint32_t> initialized;
+    };
+
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared atomics must be lock-free");
+
 public:
     Semaphore(const std::string& name, int initial_count)
-        : name_(name), unlink_on_close_(true)
-        , sem_(sem_open(name.c_str(), OpenFlags::CreateOnly, Permissions::AllReadWrite, initial_count))
+        : memory_(checked_name(name, initial_count), sizeof(State))
+        , state_(new (memory_.data()) State{ { static_cast<uint32_t>(initial_count) }, { 0 }, { MIN_SPIN }, { 0 } })
     {
-        if (!sem_) {
-            handle_error("sem_open()");
-        }
+        state_->initialized.store(INITIALIZED, std::memory_order_release);
     }
 
     Semaphore(const std::string& name)
-        : name_(name), unlink_on_close_(false)
-        , sem_(sem_open(name_.c_str(), OpenFlags::OpenOnly))
+        : memory_(SharedMemory::wait_until_sized(name))
+        , state_(static_cast<State*>(memory_.data()))
     {
-        if (!sem_) {
-            handle_error("sem_open()");
+        if (memory_.size() < sizeof(State)) {
+            throw std::system_error(EINVAL, std::generic_category(), name + ": not a semaphore");
         }
-    }
-
-    Semaphore(const Semaphore&) = delete;
 
-    ~Semaphore()
-    {
-        sem_close(sem_);
-        if (unlink_on_close_)
+        const auto deadline = std::chrono::steady_clock::now() + SharedMemory::OPEN_TIMEOUT;
+        while (state_->initialized.load(std::memory_order_acquire) != INITIALIZED)
         {
-            if (sem_unlink(name_.c_str()) == -1) {
-                handle_error("sem_unlink()");
+            if (std::chrono::steady_clock::now() >= deadline) {
+                throw std::system_error(ETIMEDOUT, std::generic_category(), name + ": never initialized");
             }
+            std::this_thread::sleep_for(SharedMemory::OPEN_POLL_INTERVAL);
         }
     }
 
+    Semaphore(const Semaphore&) = delete;
+
     Semaphore& operator=(const Semaphore&) = delete;
 
-    void release()
+    void release(uint32_t count = 1)
     {
-        if (sem_post(sem_) == -1) {
-            handle_error("sem_post()");
+        state_->count.fetch_add(count, std::memory_order_seq_cst);
+        if (state_->waiters.load(std::memory_order_seq_cst) != 0) {
+            wake(count);
         }
     }
 
     void acquire()
     {
-        if (sem_wait(sem_) == -1) {
-            handle_error("sem_wait()");
-        }
+        acquire_until(nullptr);
+    }
+
+    // Returns false if no unit became available within timeout.
+    template<typename Rep, typename Period>
+    bool acquire_for(const std::chrono::duration<Rep, Period>& timeout)
+    {
+        const auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+        return acquire_until(&deadline);
     }
 
     bool try_acquire()
     {
-        if (sem_trywait(sem_) == -1) {
-            if (errno == EAGAIN) {
-                return false;
+        auto count = state_->count.load(std::memory_order_relaxed);
+        while (count != 0)
+        {
+            if (state_->count.compare_exchange_weak(count, count - 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return true;
             }
-            else {
-                handle_error("sem_trywait()");
+        }
+        return false;
+    }
+
+    // Takes up to max_count units at once and returns how many were taken.
+    uint32_t try_acquire_up_to(uint32_t max_count)
+    {
+        auto count = state_->count.load(std::memory_order_relaxed);
+        while (count != 0)
+        {
+            const auto taken = std::min(count, max_count);
+            if (state_->count.compare_exchange_weak(count, count - taken, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return taken;
             }
         }
-        return true;
+        return 0;
     }
 
 private:
-    void handle_error(const std::string& msg)
+    // Rejects a negative count before anything is created.
+    static const std::string& checked_name(const std::string& name, int initial_count)
     {
-        fprintf(stderr, "%s: %s: %s\n", name_.c_str(), msg.c_str(), strerror(errno));
-        assert(false);
+        if (initial_count < 0) {
+            throw std::system_error(EINVAL, std::generic_category(), name + ": negative initial count");
+        }
+        return name;
     }
 
-    std::string name_;
-    bool unlink_on_close_;
-    sem_t* sem_;
+    bool acquire_until(const std::chrono::steady_clock::time_point* deadline)
+    {
+        if (try_acquire() || spin()) {
+            return true;
+        }
+
+        state_->waiters.fetch_add(1, std::memory_order_seq_cst);
+        bool acquired = false;
+
+        while (!(acquired = try_acquire()))
+        {
+            timespec timeout;
+            if (deadline)
+            {
+                const auto remaining = *deadline - std::chrono::steady_clock::now();
+                if (remaining <= std::chrono::steady_clock::duration::zero()) {
+                    break;
+                }
+
+                const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(remaining);
+                timeout.tv_sec = static_cast<time_t>(seconds.count());
+                timeout.tv_nsec = static_cast<long>(std::chrono::duration_cast<std::chrono::nanoseconds>(remaining - seconds).count());
+            }
+
+            // Sleeps only if the count is still zero when the kernel checks.
+            if (syscall(SYS_futex, &state_->count, FUTEX_WAIT, 0, deadline ? &timeout : nullptr, nullptr, 0) == -1
+                && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+            {
+                state_->waiters.fetch_sub(1, std::memory_order_relaxed);
+                throw_error("futex(FUTEX_WAIT)");
+            }
+        }
+
+        state_->waiters.fetch_sub(1, std::memory_order_relaxed);
+        return acquired;
+    }
+
+    bool spin()
+    {
+        const auto limit = state_->spin_limit.load(std::memory_order_relaxed);
+        for (uint32_t i = 0; i < limit; ++i)
+        {
+            cpu_relax();
+            if (state_->count.load(std::memory_order_relaxed) != 0 && try_acquire())
+            {
+                state_->spin_limit.store(std::min(limit * 2, MAX_SPIN), std::memory_order_relaxed);
+                return true;
+            }
+        }
+
+        state_->spin_limit.store(std::max(limit / 2, MIN_SPIN), std::memory_order_relaxed);
+        return false;
+    }
+
+    void wake(uint32_t count)
+    {
+        const auto waking = static_cast<int>(std::min<uint32_t>(count, INT32_MAX));
+        if (syscall(SYS_futex, &state_->count, FUTEX_WAKE, waking, nullptr, nullptr, 0) == -1) {
+            throw_error("futex(FUTEX_WAKE)");
+        }
+    }
+
+    static void cpu_relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    [[noreturn]] void throw_error(const std::string& msg)
+    {
+        throw std::system_error(errno, std::generic_category(), memory_.name() + ": " + msg);
+    }
+
+    SharedMemory memory_;
+    State* state_;
+
+    static constexpr uint32_t INITIALIZED = 0x53454d31;
+    static constexpr uint32_t MIN_SPIN = 16;
+    static constexpr uint32_t MAX_SPIN = 4096;
 };
-}
\ No newline at end of file
+}
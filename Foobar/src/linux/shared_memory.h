@@ -0,0 +1,136 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include "fd_flags.h"
+
+namespace ipc
+{
+// A named POSIX shared memory segment mapped read-write into this process.
+// Like Semaphore, the creating side owns the name and removes it when it is
+// destroyed; other processes open it by name.
+class SharedMemory
+{
+public:
+    // How long openers wait for a creator in another process to finish.
+    static constexpr auto OPEN_TIMEOUT = std::chrono::seconds(1);
+    static constexpr auto OPEN_POLL_INTERVAL = std::chrono::milliseconds(1);
+
+    SharedMemory(const std::string& name, size_t size)
+        : name_(name), unlink_on_close_(true), data_(nullptr), size_(size)
+    {
+        const int fd = shm_open(name_.c_str(), OpenFlags::CreateOnly | OpenFlags::ReadWrite, Permissions::AllReadWrite);
+        if (fd == -1) {
+            throw_error("shm_open()");
+        }
+
+        if (ftruncate(fd, static_cast<off_t>(size_)) == -1) {
+            close_and_throw(fd, "ftruncate()");
+        }
+
+        map(fd);
+    }
+
+    SharedMemory(const std::string& name)
+        : name_(name), unlink_on_close_(false), data_(nullptr), size_(0)
+    {
+        const int fd = shm_open(name_.c_str(), OpenFlags::OpenOnly | OpenFlags::ReadWrite, Permissions::None);
+        if (fd == -1) {
+            throw_error("shm_open()");
+        }
+
+        struct stat status;
+        if (fstat(fd, &status) == -1) {
+            close_and_throw(fd, "fstat()");
+        }
+        size_ = static_cast<size_t>(status.st_size);
+
+        map(fd);
+    }
+
+    SharedMemory(const SharedMemory&) = delete;
+
+    // Waits up to OPEN_TIMEOUT for the segment name to be sized, since its
+    // creator makes it before setting the size and an opener that maps it
+    // before then sees it empty. Returns name, for use in member
+    // initialisers; opening still fails if the segment stays empty.
+    static const std::string& wait_until_sized(const std::string& name)
+    {
+        const int fd = shm_open(name.c_str(), OpenFlags::OpenOnly | OpenFlags::ReadOnly, Permissions::None);
+        if (fd == -1) {
+            throw std::system_error(errno, std::generic_category(), name + ": shm_open()");
+        }
+
+        const auto deadline = std::chrono::steady_clock::now() + OPEN_TIMEOUT;
+        struct stat status;
+        while (fstat(fd, &status) == 0 && status.st_size == 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(OPEN_POLL_INTERVAL);
+        }
+
+        close(fd);
+        return name;
+    }
+
+    ~SharedMemory()
+    {
+        munmap(data_, size_);
+        if (unlink_on_close_) {
+            shm_unlink(name_.c_str());
+        }
+    }
+
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    void* data() const { return data_; }
+    size_t size() const { return size_; }
+    const std::string& name() const { return name_; }
+
+private:
+    void map(int fd)
+    {
+        if (size_ == 0)
+        {
+            errno = EINVAL;
+            close_and_throw(fd, "mmap()");
+        }
+
+        void* data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close_and_throw(fd, "mmap()");
+        }
+
+        // The mapping keeps the segment alive; the descriptor is not needed.
+        close(fd);
+        data_ = data;
+    }
+
+    [[noreturn]] void close_and_throw(int fd, const std::string& msg)
+    {
+        const int error = errno;
+        close(fd);
+        if (unlink_on_close_) {
+            shm_unlink(name_.c_str());
+        }
+        errno = error;
+        throw_error(msg);
+    }
+
+    [[noreturn]] void throw_error(const std::string& msg)
+    {
+        throw std::system_error(errno, std::generic_category(), name_ + ": " + msg);
+    }
+
+    std::string name_;
+    bool unlink_on_close_;
+    void* data_;
+    size_t size_;
+};
+}
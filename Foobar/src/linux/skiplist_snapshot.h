@@ -0,0 +1,550 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../concurrent_skiplist.h"
+#include "fd_flags.h"
+#include "mapped_file.h"
+
+// How keys and values are laid out in snapshot and log records. Trivially
+// copyable types are stored as their bytes; specialise for anything else.
+template<typename T>
+struct SnapshotCodec
+{
+    static_assert(std::is_trivially_copyable_v<T>, "specialise SnapshotCodec for this type");
+
+    static void encode(const T& value, std::string* out)
+    {
+        out->append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static T decode(const char* data, size_t size)
+    {
+        if (size != sizeof(T)) {
+            throw std::runtime_error("snapshot field has the wrong size");
+        }
+
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+};
+
+template<>
+struct SnapshotCodec<std::string>
+{
+    static void encode(const std::string& value, std::string* out)
+    {
+        out->append(value);
+    }
+
+    static std::string decode(const char* data, size_t size)
+    {
+        return std::string(data, size);
+    }
+};
+
+namespace snapshot_detail
+{
+inline void append_field(const std::string& field, std::string* out)
+{
+    const auto size = static_cast<uint32_t>(field.size());
+    out->append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out->append(field);
+}
+
+// Reads a length-prefixed field at *position, or returns false if fewer
+// than its bytes remain.
+inline bool read_field(const char* data, size_t size, size_t* position, const char** field, uint32_t* field_size)
+{
+    if (size - *position < sizeof(uint32_t)) {
+        return false;
+    }
+
+    std::memcpy(field_size, data + *position, sizeof(uint32_t));
+    *position += sizeof(uint32_t);
+
+    if (size - *position < *field_size) {
+        return false;
+    }
+
+    *field = data + *position;
+    *position += *field_size;
+    return true;
+}
+
+inline void sync_file(const std::string& path)
+{
+    const int fd = open(path.c_str(), OpenFlags::ReadOnly | O_CLOEXEC);
+    if (fd == -1 || fsync(fd) == -1)
+    {
+        const int error = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        throw std::system_error(error, std::generic_category(), path + ": fsync()");
+    }
+    close(fd);
+}
+
+// Makes a rename, creation or removal of path durable.
+inline void sync_parent_directory(const std::string& path)
+{
+    auto directory = std::filesystem::path(path).parent_path();
+    if (directory.empty()) {
+        directory = ".";
+    }
+    sync_file(directory.string());
+}
+
+inline uint32_t checksum(const char* data, size_t size)
+{
+    // FNV-1a; only needs to catch torn or truncated records.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 16777619u;
+    }
+    return hash;
+}
+}
+
+// A snapshot is a small header followed by every entry in ascending key
+// order, each as a length-prefixed key and a length-prefixed value.
+//
+// Time to live is not stored. Expiry deadlines are steady_clock readings,
+// which mean nothing after a restart, so save skips entries that have
+// already expired and load restores the rest as entries that never expire.
+template<typename Key, typename Value>
+class SkiplistSnapshot
+{
+    struct Header
+    {
+        uint64_t magic;
+        uint64_t entry_count;
+    };
+
+public:
+    // Writes every entry of list while writers keep running. The result
+    // reflects each key as it was at some point during the walk; pair it with
+    // SkiplistWal to recover an exact state. Returns the number of entries.
+    static size_t save(const concurrent_skiplist<Key, Value>& list, const std::string& path)
+    {
+        const auto temp_path = path + ".tmp";
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+
+        Header header{ MAGIC, 0 };
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        std::string record;
+        list.for_each([&](const Key& key, const Value& value) {
+            record.clear();
+            encode_entry(key, value, &record);
+            file.write(record.data(), record.size());
+            ++header.entry_count;
+        });
+
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.close();
+        if (!file) {
+            throw std::system_error(errno, std::generic_category(), temp_path + ": write failed");
+        }
+
+        snapshot_detail::sync_file(temp_path);
+        std::filesystem::rename(temp_path, path);
+        snapshot_detail::sync_parent_directory(path);
+        return header.entry_count;
+    }
+
+    // Maps the snapshot at path and bulk builds the empty list from it in one
+    // linear pass. Returns the number of entries loaded.
+    static size_t load(const std::string& path, concurrent_skiplist<Key, Value>* list)
+    {
+        MappedFile file(path, MapMode::CopyOnWrite);
+        const auto* data = static_cast<const char*>(file.data());
+
+        Header header;
+        if (file.size() < sizeof(header)) {
+            throw std::runtime_error(path + ": not a skiplist snapshot");
+        }
+
+        std::memcpy(&header, data, sizeof(header));
+        if (header.magic != MAGIC) {
+            throw std::runtime_error(path + ": not a skiplist snapshot");
+        }
+
+        list->bulk_build(
+            iterator(data, file.size(), sizeof(header), header.entry_count),
+            iterator(data, file.size(), sizeof(header), 0));
+
+        return header.entry_count;
+    }
+
+private:
+    // Decodes entries straight out of the mapping as bulk_build consumes them.
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::pair<Key, Value>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = value_type;
+
+        iterator(const char* data, size_t size, size_t position, uint64_t remaining)
+            : data_(data), size_(size), position_(position), remaining_(remaining)
+        {
+        }
+
+        value_type operator*() const
+        {
+            auto position = position_;
+            const char* key;
+            const char* value;
+            uint32_t key_size;
+            uint32_t value_size;
+            read_entry(&position, &key, &key_size, &value, &value_size);
+            return { SnapshotCodec<Key>::decode(key, key_size), SnapshotCodec<Value>::decode(value, value_size) };
+        }
+
+        iterator& operator++()
+        {
+            const char* key;
+            const char* value;
+            uint32_t key_size;
+            uint32_t value_size;
+            read_entry(&position_, &key, &key_size, &value, &value_size);
+            --remaining_;
+            return *this;
+        }
+
+        bool operator==(const iterator& other) const { return remaining_ == other.remaining_; }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+
+    private:
+        void read_entry(size_t* position, const char** key, uint32_t* key_size, const char** value, uint32_t* value_size) const
+        {
+            if (!snapshot_detail::read_field(data_, size_, position, key, key_size)
+                || !snapshot_detail::read_field(data_, size_, position, value, value_size))
+            {
+                throw std::runtime_error("skiplist snapshot is truncated");
+            }
+        }
+
+        const char* data_;
+        size_t size_;
+        size_t position_;
+        uint64_t remaining_;
+    };
+
+    static void encode_entry(const Key& key, const Value& value, std::string* out)
+    {
+        std::string field;
+        SnapshotCodec<Key>::encode(key, &field);
+        snapshot_detail::append_field(field, out);
+
+        field.clear();
+        SnapshotCodec<Value>::encode(value, &field);
+        snapshot_detail::append_field(field, out);
+    }
+
+    static constexpr uint64_t MAGIC = 0x31307370616e736c; // "lsnaps01"
+};
+
+// Write-ahead log in front of a concurrent_skiplist. Mutations go through
+// the log, which appends a checksummed record before applying them, so the
+// list can be rebuilt from the latest snapshot plus the log after a restart.
+//
+// Appends are buffered by the OS; call sync() to make everything logged so
+// far durable.
+template<typename Key, typename Value>
+class SkiplistWal
+{
+    struct Op
+    {
+        enum : uint8_t
+        {
+            AddOrUpdate = 1,
+            Remove = 2,
+        };
+    };
+
+public:
+    SkiplistWal(const std::string& path, concurrent_skiplist<Key, Value>* list)
+        : path_(path), list_(list), fd_(open_log(path))
+    {
+    }
+
+    SkiplistWal(const SkiplistWal&) = delete;
+    SkiplistWal& operator=(const SkiplistWal&) = delete;
+
+    ~SkiplistWal()
+    {
+        close(fd_);
+    }
+
+    void add_or_update(const Key& key, Value value)
+    {
+        std::string record;
+        encode_record(Op::AddOrUpdate, key, &value, &record);
+
+        std::scoped_lock<std::mutex> lock(stripe(key));
+        append(record);
+        list_->add_or_update(key, std::move(value));
+    }
+
+    bool try_remove(const Key& key)
+    {
+        std::string record;
+        encode_record(Op::Remove, key, nullptr, &record);
+
+        std::scoped_lock<std::mutex> lock(stripe(key));
+        append(record);
+        return list_->try_remove(key);
+    }
+
+    void sync()
+    {
+        if (fdatasync(fd_) == -1) {
+            throw_error("fdatasync()");
+        }
+    }
+
+    // Starts a fresh log, saves a snapshot to snapshot_path and drops the old
+    // log. Writers are paused only while the log file is switched, not while
+    // the snapshot is written. If this is interrupted, recover() still
+    // restores everything from the old snapshot and both logs.
+    //
+    // A log left behind by an interrupted checkpoint holds records that are
+    // in no snapshot yet, so this refuses to run until recover() has folded
+    // it into one.
+    void checkpoint(const std::string& snapshot_path)
+    {
+        int old_fd;
+        {
+            // Holding every stripe waits out in-flight mutations, so every
+            // record in the old log is already applied to the list when the
+            // snapshot starts.
+            std::array<std::unique_lock<std::mutex>, STRIPES> locks;
+            for (size_t i = 0; i < STRIPES; ++i) {
+                locks[i] = std::unique_lock<std::mutex>(stripes_[i]);
+            }
+
+            std::scoped_lock<std::mutex> append_lock(append_mutex_);
+            if (std::filesystem::exists(old_path(path_))) {
+                throw std::runtime_error(old_path(path_) + ": left by an interrupted checkpoint; run recover() first");
+            }
+            std::filesystem::rename(path_, old_path(path_));
+            old_fd = std::exchange(fd_, open_log(path_));
+        }
+
+        const bool synced = fdatasync(old_fd) == 0;
+        close(old_fd);
+        if (!synced) {
+            throw_error("fdatasync()");
+        }
+        // The rename and the new log must be on disk before the snapshot
+        // replaces the one the old log applies to.
+        snapshot_detail::sync_parent_directory(path_);
+
+        SkiplistSnapshot<Key, Value>::save(*list_, snapshot_path);
+        std::filesystem::remove(old_path(path_));
+        snapshot_detail::sync_parent_directory(path_);
+    }
+
+    // Rebuilds an empty list from snapshot_path and the logs at wal_path, any
+    // of which may be missing. Returns the number of log records replayed.
+    //
+    // A log left by an interrupted checkpoint is folded into a new snapshot
+    // and only then removed. The current log is kept; replaying it over a
+    // snapshot that already holds its effects leaves every key as its last
+    // record set it. A torn record at the end of the current log is cut off,
+    // as records appended after it would never be replayed.
+    static size_t recover(const std::string& snapshot_path, const std::string& wal_path, concurrent_skiplist<Key, Value>* list)
+    {
+        if (std::filesystem::exists(snapshot_path)) {
+            SkiplistSnapshot<Key, Value>::load(snapshot_path, list);
+        }
+
+        size_t replayed = 0;
+        if (std::filesystem::exists(old_path(wal_path))) {
+            replayed += replay(old_path(wal_path), list);
+        }
+
+        if (std::filesystem::exists(wal_path))
+        {
+            size_t valid_size;
+            replayed += replay(wal_path, list, &valid_size);
+            if (valid_size < std::filesystem::file_size(wal_path))
+            {
+                std::filesystem::resize_file(wal_path, valid_size);
+                snapshot_detail::sync_file(wal_path);
+            }
+        }
+
+        if (std::filesystem::exists(old_path(wal_path)))
+        {
+            SkiplistSnapshot<Key, Value>::save(*list, snapshot_path);
+            std::filesystem::remove(old_path(wal_path));
+            snapshot_detail::sync_parent_directory(wal_path);
+        }
+        return replayed;
+    }
+
+    // Applies the records of one log in order and stops at the first torn or
+    // truncated record, which can only be the tail of a crashed write. If
+    // valid_size is given, it receives the length of the records applied.
+    static size_t replay(const std::string& path, concurrent_skiplist<Key, Value>* list, size_t* valid_size = nullptr)
+    {
+        if (valid_size) {
+            *valid_size = 0;
+        }
+        if (std::filesystem::file_size(path) == 0) {
+            return 0;
+        }
+
+        MappedFile file(path, MapMode::CopyOnWrite);
+        const auto* data = static_cast<const char*>(file.data());
+        const auto size = file.size();
+
+        size_t position = 0;
+        size_t replayed = 0;
+        while (true)
+        {
+            const char* body;
+            uint32_t body_size;
+            if (!snapshot_detail::read_field(data, size, &position, &body, &body_size)
+                || size - position < sizeof(uint32_t)) {
+                break;
+            }
+
+            uint32_t checksum;
+            std::memcpy(&checksum, data + position, sizeof(checksum));
+            position += sizeof(checksum);
+            if (body_size == 0 || checksum != snapshot_detail::checksum(body, body_size)) {
+                break;
+            }
+
+            size_t field_position = 1;
+            const char* key;
+            const char* value;
+            uint32_t key_size;
+            uint32_t value_size;
+            if (!snapshot_detail::read_field(body, body_size, &field_position, &key, &key_size)) {
+                break;
+            }
+
+            if (body[0] == Op::AddOrUpdate)
+            {
+                if (!snapshot_detail::read_field(body, body_size, &field_position, &value, &value_size)) {
+                    break;
+                }
+                list->add_or_update(SnapshotCodec<Key>::decode(key, key_size), SnapshotCodec<Value>::decode(value, value_size));
+            }
+            else {
+                list->try_remove(SnapshotCodec<Key>::decode(key, key_size));
+            }
+
+            ++replayed;
+            if (valid_size) {
+                *valid_size = position;
+            }
+        }
+
+        return replayed;
+    }
+
+private:
+    // A record is a length-prefixed body followed by the checksum of the
+    // body. The body is the op byte, the key and, for updates, the value.
+    static void encode_record(uint8_t op, const Key& key, const Value* value, std::string* out)
+    {
+        std::string body(1, static_cast<char>(op));
+        std::string field;
+        SnapshotCodec<Key>::encode(key, &field);
+        snapshot_detail::append_field(field, &body);
+
+        if (value)
+        {
+            field.clear();
+            SnapshotCodec<Value>::encode(*value, &field);
+            snapshot_detail::append_field(field, &body);
+        }
+
+        snapshot_detail::append_field(body, out);
+        const auto checksum = snapshot_detail::checksum(body.data(), body.size());
+        out->append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+    }
+
+    void append(const std::string& record)
+    {
+        std::scoped_lock<std::mutex> lock(append_mutex_);
+
+        size_t written = 0;
+        while (written < record.size())
+        {
+            const auto result = write(fd_, record.data() + written, record.size() - written);
+            if (result == -1)
+            {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw_error("write()");
+            }
+            written += static_cast<size_t>(result);
+        }
+    }
+
+    // Mutations of one key are logged and applied under the same stripe
+    // lock, so the log order of a key matches the order its updates land in
+    // the list.
+    std::mutex& stripe(const Key& key)
+    {
+        return stripes_[std::hash<Key>{}(key) % STRIPES];
+    }
+
+    static int open_log(const std::string& path)
+    {
+        const int fd = open(path.c_str(), OpenFlags::OpenOrCreate | OpenFlags::WriteOnly | O_APPEND | O_CLOEXEC,
+            Permissions::OwnerReadWrite | Permissions::GroupRead);
+        if (fd == -1) {
+            throw std::system_error(errno, std::generic_category(), path + ": open()");
+        }
+        return fd;
+    }
+
+    static std::string old_path(const std::string& path)
+    {
+        return path + ".old";
+    }
+
+    [[noreturn]] void throw_error(const std::string& msg)
+    {
+        throw std::system_error(errno, std::generic_category(), path_ + ": " + msg);
+    }
+
+    static constexpr size_t STRIPES = 64;
+
+    std::string path_;
+    concurrent_skiplist<Key, Value>* list_;
+    int fd_;
+    std::mutex append_mutex_;
+    std::array<std::mutex, STRIPES> stripes_;
+};
@@ -1,9 +1,152 @@
+#pragma once
+
 #include <pthread.h>
+#include <sched.h>
 
 #include <cassert>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Attributes a Thread is created with. Every setter returns *this, so options
+// can be built in one expression:
+//
+//     Thread t(ThreadOptions().name("ingest").cpu(3).stack_size(64 * 1024), f);
+//
+// Anything left unset keeps the pthread default.
+class ThreadOptions
+{
+public:
+    // Restricts the thread to the given CPU; call repeatedly to allow several.
+    // CPU_SET ignores ids outside [0, CPU_SETSIZE), so those are rejected
+    // here rather than silently leaving the thread unpinned.
+    ThreadOptions& cpu(int cpu)
+    {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            throw std::invalid_argument("cpu id out of range: " + std::to_string(cpu));
+        }
+        cpus_.push_back(cpu);
+        return *this;
+    }
+
+    ThreadOptions& stack_size(size_t bytes)
+    {
+        stack_size_ = bytes;
+        return *this;
+    }
+
+    ThreadOptions& guard_size(size_t bytes)
+    {
+        guard_size_ = bytes;
+        has_guard_size_ = true;
+        return *this;
+    }
+
+    // policy is SCHED_OTHER, SCHED_FIFO, SCHED_RR, ...; real-time policies
+    // usually need CAP_SYS_NICE.
+    ThreadOptions& scheduling(int policy, int priority)
+    {
+        policy_ = policy;
+        priority_ = priority;
+        has_scheduling_ = true;
+        return *this;
+    }
+
+    // Shown by perf, top and gdb. Linux truncates names to 15 characters.
+    ThreadOptions& name(const std::string& name)
+    {
+        name_ = name.substr(0, MAX_NAME_LENGTH);
+        return *this;
+    }
+
+    const std::string& name() const { return name_; }
+
+    // Fills attr, which must already be initialised.
+    void apply(pthread_attr_t* attr) const
+    {
+        if (stack_size_ != 0) {
+            check(pthread_attr_setstacksize(attr, stack_size_), "pthread_attr_setstacksize()");
+        }
+
+        if (has_guard_size_) {
+            check(pthread_attr_setguardsize(attr, guard_size_), "pthread_attr_setguardsize()");
+        }
+
+        if (!cpus_.empty())
+        {
+            const auto set = cpu_set();
+            check(pthread_attr_setaffinity_np(attr, sizeof(set), &set), "pthread_attr_setaffinity_np()");
+        }
+
+        if (has_scheduling_)
+        {
+            sched_param param{};
+            param.sched_priority = priority_;
+            check(pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED), "pthread_attr_setinheritsched()");
+            check(pthread_attr_setschedpolicy(attr, policy_), "pthread_attr_setschedpolicy()");
+            check(pthread_attr_setschedparam(attr, &param), "pthread_attr_setschedparam()");
+        }
+    }
+
+    // Applies everything except the stack to the calling thread, for threads
+    // this code did not create.
+    void apply_to_current_thread() const
+    {
+        const auto self = pthread_self();
+
+        if (!cpus_.empty())
+        {
+            const auto set = cpu_set();
+            check(pthread_setaffinity_np(self, sizeof(set), &set), "pthread_setaffinity_np()");
+        }
+
+        if (has_scheduling_)
+        {
+            sched_param param{};
+            param.sched_priority = priority_;
+            check(pthread_setschedparam(self, policy_, &param), "pthread_setschedparam()");
+        }
+
+        if (!name_.empty()) {
+            check(pthread_setname_np(self, name_.c_str()), "pthread_setname_np()");
+        }
+    }
+
+    static void check(int result, const char* msg)
+    {
+        if (result != 0) {
+            throw std::system_error(result, std::generic_category(), msg);
+        }
+    }
+
+private:
+    cpu_set_t cpu_set() const
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus_) {
+            CPU_SET(cpu, &set);
+        }
+        return set;
+    }
+
+    std::vector<int> cpus_;
+    size_t stack_size_ = 0;
+    size_t guard_size_ = 0;
+    bool has_guard_size_ = false;
+    int policy_ = SCHED_OTHER;
+    int priority_ = 0;
+    bool has_scheduling_ = false;
+    std::string name_;
+
+    static constexpr size_t MAX_NAME_LENGTH = 15;
+};
 
 class Thread
 {
@@ -18,7 +161,7 @@ class Thread
     class Callable : public CallableBase
     {
     public:
-        Callable(Function&& func) : func_(std::move(func)) {}
+        Callable(Function func) : func_(std::move(func)) {}
         void invoke() override { func_(); }
     private:
         Function func_;
@@ -27,11 +170,35 @@ class Thread
 public:
     template <typename Function>
     Thread(Function&& func)
-        : callable_(std::make_unique<Callable<Function>>(std::move(func)))
-        , joinable_(true)
+        : Thread(ThreadOptions(), std::forward<Function>(func))
     {
-        int r = pthread_create(&thread_handle_, nullptr, &Thread::execute, callable_.get());
-        assert(r == 0);
+    }
+
+    template <typename Function>
+    Thread(const ThreadOptions& options, Function&& func)
+        : callable_(std::make_unique<Callable<std::decay_t<Function>>>(std::forward<Function>(func)))
+        , joinable_(false)
+    {
+        pthread_attr_t attr;
+        ThreadOptions::check(pthread_attr_init(&attr), "pthread_attr_init()");
+
+        try {
+            options.apply(&attr);
+        }
+        catch (...) {
+            pthread_attr_destroy(&attr);
+            throw;
+        }
+
+        const int r = pthread_create(&thread_handle_, &attr, &Thread::execute, callable_.get());
+        pthread_attr_destroy(&attr);
+        ThreadOptions::check(r, "pthread_create()");
+        joinable_ = true;
+
+        // Naming from here avoids waiting for the new thread to start.
+        if (!options.name().empty()) {
+            pthread_setname_np(thread_handle_, options.name().c_str());
+        }
     }
 
     ~Thread()
@@ -84,6 +251,7 @@ private:
     static void* execute(void* ptr)
     {
         static_cast<CallableBase*>(ptr)->invoke();
+        return nullptr;
     }
 
     pthread_t thread_handle_;
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "concurrent_skiplist.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <utility>
+
+// A concurrent map that hashes each key into one of Shards independent
+// skiplists. Point operations only touch one shard, so searches are shorter
+// and writers on different shards never meet near a shared head. Ordered
+// iteration is still possible but merges every shard, so it is meant for
+// occasional scans.
+template <typename Key, typename Value, size_t Shards = 16, typename Hash = std::hash<Key>>
+class sharded_map
+{
+	static_assert(Shards > 0, "sharded_map needs at least one shard");
+
+	using shard_list = concurrent_skiplist<Key, Value>;
+
+	struct alignas(64) shard
+	{
+		shard_list list;
+		std::atomic<int64_t> size{ 0 };
+	};
+
+public:
+	struct shard_stats
+	{
+		int64_t size;
+		uint64_t contention;
+	};
+
+	explicit sharded_map(Hash hash = Hash())
+		: _hash(std::move(hash))
+	{
+	}
+
+	sharded_map(const sharded_map&) = delete;
+	sharded_map& operator=(const sharded_map&) = delete;
+
+	bool try_get_value(const Key& key, Value* out_value) const
+	{
+		return shard_for(key).list.try_get_value(key, out_value);
+	}
+
+	// Returns true if the key was added and false if an existing value was
+	// replaced.
+	bool add_or_update(const Key& key, Value value)
+	{
+		auto& s = shard_for(key);
+		const bool added = s.list.add_or_update(key, std::move(value));
+		if (added) {
+			s.size.fetch_add(1, std::memory_order_relaxed);
+		}
+		return added;
+	}
+
+	bool try_add(const Key& key, Value value)
+	{
+		auto& s = shard_for(key);
+		const bool added = s.list.try_add(key, std::move(value));
+		if (added) {
+			s.size.fetch_add(1, std::memory_order_relaxed);
+		}
+		return added;
+	}
+
+	bool try_update(const Key& key, Value value)
+	{
+		return shard_for(key).list.try_update(key, std::move(value));
+	}
+
+	bool try_remove(const Key& key)
+	{
+		auto& s = shard_for(key);
+		const bool removed = s.list.try_remove(key);
+		if (removed) {
+			s.size.fetch_sub(1, std::memory_order_relaxed);
+		}
+		return removed;
+	}
+
+	// Exact when no writer is running; otherwise a recent approximation.
+	size_t size() const
+	{
+		int64_t total = 0;
+		for (const auto& s : _shards) {
+			total += s.size.load(std::memory_order_relaxed);
+		}
+		return total > 0 ? static_cast<size_t>(total) : 0;
+	}
+
+	std::array<shard_stats, Shards> stats() const
+	{
+		std::array<shard_stats, Shards> result;
+		for (size_t i = 0; i < Shards; ++i) {
+			result[i] = { _shards[i].size.load(std::memory_order_relaxed), _shards[i].list.contention_count() };
+		}
+		return result;
+	}
+
+	// Visits the entries of all shards in ascending key order by merging the
+	// shard iterators. Gives the same guarantees under concurrent writers as
+	// concurrent_skiplist::const_iterator.
+	class const_iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = std::pair<Key, Value>;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const value_type*;
+		using reference = value_type;
+
+		const_iterator() = default;
+
+		const Key& key() const { return _positions[_current].key(); }
+		Value value() const { return _positions[_current].value(); }
+		value_type operator*() const { return { key(), value() }; }
+
+		const_iterator& operator++()
+		{
+			++_positions[_current];
+			select_smallest();
+			return *this;
+		}
+
+		bool operator==(const const_iterator& other) const
+		{
+			if (_current != other._current) {
+				return false;
+			}
+			return _current == Shards || _positions[_current] == other._positions[_current];
+		}
+
+		bool operator!=(const const_iterator& other) const { return !(*this == other); }
+
+	private:
+		friend class sharded_map;
+
+		explicit const_iterator(const sharded_map* map)
+			: _map(map)
+		{
+			for (size_t i = 0; i < Shards; ++i) {
+				_positions[i] = map->_shards[i].list.begin();
+			}
+			select_smallest();
+		}
+
+		// Shard counts are small, so a linear scan beats maintaining a heap.
+		void select_smallest()
+		{
+			_current = Shards;
+			for (size_t i = 0; i < Shards; ++i)
+			{
+				if (_positions[i] == _map->_shards[i].list.end()) {
+					continue;
+				}
+
+				if (_current == Shards || _positions[i].key() < _positions[_current].key()) {
+					_current = i;
+				}
+			}
+		}
+
+		const sharded_map* _map = nullptr;
+		std::array<typename shard_list::const_iterator, Shards> _positions;
+		size_t _current = Shards;
+	};
+
+	const_iterator begin() const
+	{
+		return const_iterator(this);
+	}
+
+	const_iterator end() const
+	{
+		return const_iterator();
+	}
+
+private:
+	size_t shard_index(const Key& key) const
+	{
+		// Fibonacci hashing spreads weak hashes such as the identity hash
+		// std::hash uses for integers.
+		const uint64_t mixed = static_cast<uint64_t>(_hash(key)) * 0x9E3779B97F4A7C15ULL;
+		return static_cast<size_t>(mixed >> 32) % Shards;
+	}
+
+	shard& shard_for(const Key& key)
+	{
+		return _shards[shard_index(key)];
+	}
+
+	const shard& shard_for(const Key& key) const
+	{
+		return _shards[shard_index(key)];
+	}
+
+	Hash _hash;
+	std::array<shard, Shards> _shards;
+};
@@ -3,10 +3,13 @@
 #include <chrono>
 #include <cstdint>
 
-class stopwatch
+// Clock is any chrono clock; tsc_clock makes start and elapsed_* cost a few
+// cycles where the default costs a call into the OS clock.
+template<typename Clock = std::chrono::high_resolution_clock>
+class basic_stopwatch
 {
 public:
-	stopwatch()
+	basic_stopwatch()
 	{
 		reset();
 	}
@@ -63,19 +66,20 @@ private:
 
 	void set_running()
 	{
-		_start_time = std::chrono::high_resolution_clock::now();
+		_start_time = Clock::now();
 	}
 
 	std::chrono::nanoseconds running_nanoseconds() const
 	{
 		return running()
-			? std::chrono::high_resolution_clock::now() - _start_time
+			? std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - _start_time)
 			: std::chrono::nanoseconds::zero();
 	}
 
-	std::chrono::high_resolution_clock::time_point _start_time;
+	typename Clock::time_point _start_time;
 	std::chrono::nanoseconds _elapsed_nano;
 
-	static constexpr std::chrono::high_resolution_clock::time_point NOT_RUNNING
-		= std::chrono::high_resolution_clock::time_point::min();
+	static constexpr typename Clock::time_point NOT_RUNNING = Clock::time_point::min();
 };
+
+using stopwatch = basic_stopwatch<>;
@@ -1,14 +1,20 @@
 #pragma once
 
 #include "blocking_queue.h"
+#include "timer_wheel.h"
+#include "trace.h"
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <stdexcept>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
 class thread_pool
@@ -103,15 +109,47 @@ class thread_pool
 		mutable std::mutex _mutex;
 	};
 
+	// Owns a worker thread of whatever type the pool's thread factory returns.
+	// The thread is joined when the worker is destroyed.
+	class worker_base
+	{
+	public:
+		virtual ~worker_base() {}
+	};
+
+	template <typename Thread>
+	class worker : public worker_base
+	{
+	public:
+		worker(Thread&& thread) : _thread(std::move(thread)) {}
+
+	private:
+		Thread _thread;
+	};
+
 public:
+	using timer_handle = timer_wheel::handle;
+
 	thread_pool(size_t num_threads = std::thread::hardware_concurrency())
+		: thread_pool(num_threads, [](size_t, std::function<void()> body) { return std::jthread(std::move(body)); })
+	{
+	}
+
+	// factory(index, body) must start a thread running body and return an
+	// object that joins it on destruction, such as std::jthread or a Thread
+	// built from ThreadOptions to pin, name or size the stack of workers.
+	template <typename ThreadFactory>
+	thread_pool(size_t num_threads, ThreadFactory factory)
 		: _done(false)
+		, _timers(std::make_shared<timer_wheel>())
 		, _queues(num_threads)
 	{
 		try
 		{
-			for (size_t i = 0; i < _queues.size(); ++i) {
-				_threads.emplace_back(&thread_pool::worker_thread, this, i);
+			for (size_t i = 0; i < _queues.size(); ++i)
+			{
+				auto thread = factory(i, [this, i] { worker_thread(i); });
+				_threads.push_back(std::make_unique<worker<decltype(thread)>>(std::move(thread)));
 			}
 		}
 		catch (...)
@@ -132,15 +170,39 @@ public:
 		using result_t = std::invoke_result_t<Function>;
 		std::packaged_task<result_t()> task(std::move(func));
 		std::future<result_t> result(task.get_future());
+		enqueue(std::move(task));
+		return result;
+	}
 
-		if (s_local_work_queue) {
-			s_local_work_queue->push(std::move(task));
-		}
-		else {
-			_pool_work_queue.push(std::move(task));
+	// Runs func on the pool once delay has passed. Timers are kept in a
+	// timing wheel with millisecond ticks that the workers check between
+	// tasks, so they can fire up to a tick late, or later if every worker
+	// is busy with a long task. There is no future to carry an exception
+	// from func, so one that is thrown is dropped.
+	template <typename Function>
+	timer_handle submit_after(timer_wheel::clock::duration delay, Function func)
+	{
+		return submit_at(timer_wheel::clock::now() + delay, std::move(func));
+	}
+
+	template <typename Function>
+	timer_handle submit_at(timer_wheel::clock::time_point time, Function func)
+	{
+		return _timers->schedule(time, timer_wheel::clock::duration::zero(), shareable(std::move(func)));
+	}
+
+	// Runs func every period, starting one period from now, until the
+	// returned handle is cancelled. Runs never overlap; periods missed while
+	// a run was late are skipped. If func throws, the exception is dropped
+	// and the timer is cancelled.
+	template <typename Function>
+	timer_handle submit_every(timer_wheel::clock::duration period, Function func)
+	{
+		if (period <= timer_wheel::clock::duration::zero()) {
+			throw std::invalid_argument("period must be positive");
 		}
 
-		return result;
+		return _timers->schedule(timer_wheel::clock::now() + period, period, shareable(std::move(func)));
 	}
 
 	void run_pending_task()
@@ -150,14 +212,64 @@ public:
 		 || try_pop_from_pool(&task)
 		 || try_steal_from_other_queue(&task))
 		{
+			TRACE_SPAN("thread_pool", "task");
 			task.run();
+
+			if (++s_tasks_since_timer_check >= TIMER_CHECK_INTERVAL) {
+				expire_timers();
+			}
 			return;
 		}
 
+		expire_timers();
 		std::this_thread::yield();
 	}
 
+	size_t thread_count() const
+	{
+		return _queues.size();
+	}
+
+	// Tasks taken from another worker's queue since the pool started.
+	uint64_t steal_count() const
+	{
+		return _steals.load(std::memory_order_relaxed);
+	}
+
 private:
+	template <typename Task>
+	void enqueue(Task&& task)
+	{
+		if (s_local_work_queue) {
+			s_local_work_queue->push(std::forward<Task>(task));
+		}
+		else {
+			_pool_work_queue.push(std::forward<Task>(task));
+		}
+	}
+
+	// Moves timers that have fallen due onto the pool's queue.
+	void expire_timers()
+	{
+		s_tasks_since_timer_check = 0;
+		_timers->expire(timer_wheel::clock::now(), [this](std::shared_ptr<timer_wheel::timer> timer) {
+			_pool_work_queue.push(task([timer = std::move(timer)] { timer_wheel::fire(timer); }));
+		});
+	}
+
+	// std::function needs a copyable target; move-only callables are held
+	// by a shared_ptr instead.
+	template <typename Function>
+	static std::function<void()> shareable(Function func)
+	{
+		if constexpr (std::is_copy_constructible_v<Function>) {
+			return func;
+		}
+		else {
+			return [func = std::make_shared<Function>(std::move(func))] { (*func)(); };
+		}
+	}
+
 	void worker_thread(size_t thread_index)
 	{
 		s_local_thread_index = thread_index;
@@ -183,7 +295,10 @@ private:
 		for (size_t i = 1; i <= _queues.size(); ++i)
 		{
 			const auto index = (s_local_thread_index + i) % _queues.size();
-			if (_queues[index].try_steal(out_task)) {
+			if (_queues[index].try_steal(out_task))
+			{
+				TRACE_INSTANT("thread_pool", "steal");
+				_steals.fetch_add(1, std::memory_order_relaxed);
 				return true;
 			}
 		}
@@ -192,10 +307,15 @@ private:
 	}
 
 	std::atomic_bool _done;
+	std::atomic<uint64_t> _steals{ 0 };
+	std::shared_ptr<timer_wheel> _timers;
 	blocking_queue<task> _pool_work_queue;
 	std::vector<work_stealing_queue> _queues;
-	std::vector<std::jthread> _threads;
+	std::vector<std::unique_ptr<worker_base>> _threads;
 
 	static thread_local inline work_stealing_queue* s_local_work_queue;
 	static thread_local inline size_t s_local_thread_index;
+	static thread_local inline size_t s_tasks_since_timer_check;
+
+	static constexpr size_t TIMER_CHECK_INTERVAL = 64;
 };
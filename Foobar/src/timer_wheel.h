@@ -0,0 +1,361 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// A hierarchical timing wheel (Varghese and Lauck) with millisecond ticks.
+// Four levels of 256 slots cover about 49 days; later deadlines are parked
+// in the top level and re-filed as they come into range. Scheduling and
+// cancelling are O(1); expire() costs one step per elapsed tick plus the
+// timers that move down a level or fall due.
+//
+// The wheel never runs callbacks itself: expire() hands due timers to the
+// caller, which runs them with fire(). thread_pool uses it this way so that
+// its workers, rather than a thread per timer, service the timers.
+class timer_wheel : public std::enable_shared_from_this<timer_wheel>
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	class timer
+	{
+	private:
+		friend class timer_wheel;
+
+		std::function<void()> _callback;
+		clock::duration _period{};
+		uint64_t _expiry = 0;
+		timer* _previous = nullptr;
+		timer* _next = nullptr;
+		timer** _slot = nullptr;
+		bool _scheduled = false;
+		// Set by cancel, and by the single run of a one-shot timer, so that
+		// exactly one of the two wins.
+		std::atomic<bool> _cancelled{ false };
+		// Keeps the timer alive while it is filed in the wheel.
+		std::shared_ptr<timer> _self;
+		std::weak_ptr<timer_wheel> _wheel;
+	};
+
+	// Refers to a scheduled timer. Handles may outlive the wheel; cancelling
+	// then does nothing.
+	class handle
+	{
+	public:
+		handle() = default;
+
+		// Stops the timer from firing again. Returns false if it had already
+		// fired for the last time or was cancelled before. A run that has
+		// already started is not interrupted.
+		bool cancel()
+		{
+			if (!_timer) {
+				return false;
+			}
+
+			auto wheel = _timer->_wheel.lock();
+			return wheel && wheel->cancel(_timer.get());
+		}
+
+	private:
+		friend class timer_wheel;
+
+		explicit handle(std::shared_ptr<timer> timer)
+			: _timer(std::move(timer))
+		{
+		}
+
+		std::shared_ptr<timer> _timer;
+	};
+
+	explicit timer_wheel(clock::time_point start = clock::now())
+		: _start(start)
+	{
+	}
+
+	timer_wheel(const timer_wheel&) = delete;
+	timer_wheel& operator=(const timer_wheel&) = delete;
+
+	~timer_wheel()
+	{
+		for (auto& level : _levels)
+		{
+			for (auto& slot : level) {
+				release(slot);
+			}
+		}
+		release(_due);
+	}
+
+	// Schedules callback to run at when and, if period is non-zero, every
+	// period after that. The wheel must be owned by a shared_ptr.
+	handle schedule(clock::time_point when, clock::duration period, std::function<void()> callback)
+	{
+		auto entry = std::make_shared<timer>();
+		entry->_callback = std::move(callback);
+		entry->_period = period;
+		entry->_wheel = weak_from_this();
+
+		std::scoped_lock<std::mutex> lock(_mutex);
+		entry->_expiry = tick_at_or_after(when);
+		file(entry.get());
+		entry->_self = entry;
+		return handle(entry);
+	}
+
+	// Advances the wheel to now and calls on_due(std::shared_ptr<timer>) for
+	// every timer that fell due, after releasing the wheel's lock. Returns
+	// without doing anything if another thread is already expiring timers.
+	template<typename OnDue>
+	void expire(clock::time_point now, OnDue on_due)
+	{
+		std::vector<std::shared_ptr<timer>> due;
+		{
+			std::unique_lock<std::mutex> lock(_mutex, std::try_to_lock);
+			if (!lock.owns_lock()) {
+				return;
+			}
+
+			const uint64_t target = ticks_elapsed(now);
+			if (_pending == 0) {
+				_now_tick = std::max(_now_tick, target);
+			}
+
+			while (_now_tick < target)
+			{
+				++_now_tick;
+				cascade();
+				take(&_levels[0][_now_tick & SLOT_MASK], &due);
+			}
+			take(&_due, &due);
+		}
+
+		for (auto& entry : due) {
+			on_due(std::move(entry));
+		}
+	}
+
+	// Runs a timer handed out by expire and, if it is periodic and was not
+	// cancelled meanwhile, files it again one period later. A timer has no
+	// caller to report to, so an exception from its callback is dropped and
+	// a periodic timer whose callback throws is cancelled rather than left
+	// to fail every period.
+	static void fire(const std::shared_ptr<timer>& entry)
+	{
+		if (entry->_period == clock::duration::zero())
+		{
+			if (!entry->_cancelled.exchange(true, std::memory_order_acq_rel)) {
+				run_callback(*entry);
+			}
+			return;
+		}
+
+		if (entry->_cancelled.load(std::memory_order_acquire)) {
+			return;
+		}
+
+		if (!run_callback(*entry))
+		{
+			entry->_cancelled.store(true, std::memory_order_release);
+			return;
+		}
+
+		if (auto wheel = entry->_wheel.lock()) {
+			wheel->refile(entry);
+		}
+	}
+
+	// Number of timers waiting to fire.
+	size_t pending() const
+	{
+		std::scoped_lock<std::mutex> lock(_mutex);
+		return _pending;
+	}
+
+private:
+	using slot = timer*;
+
+	// Returns false if the callback threw.
+	static bool run_callback(timer& entry) noexcept
+	{
+		try
+		{
+			entry._callback();
+			return true;
+		}
+		catch (...)
+		{
+			return false;
+		}
+	}
+
+	bool cancel(timer* entry)
+	{
+		std::scoped_lock<std::mutex> lock(_mutex);
+		if (entry->_cancelled.exchange(true, std::memory_order_acq_rel)) {
+			return false;
+		}
+
+		// An unscheduled timer is waiting to run or running; fire() sees the
+		// flag and skips it or does not refile it.
+		if (entry->_scheduled)
+		{
+			unlink(entry);
+			entry->_self.reset();
+		}
+		return true;
+	}
+
+	void refile(const std::shared_ptr<timer>& entry)
+	{
+		std::scoped_lock<std::mutex> lock(_mutex);
+		if (entry->_cancelled.load(std::memory_order_relaxed)) {
+			return;
+		}
+
+		// Missed periods are skipped rather than run back to back.
+		const uint64_t period_ticks = std::max<uint64_t>(1, ticks_rounded_up(entry->_period));
+		entry->_expiry += period_ticks;
+		if (entry->_expiry <= _now_tick) {
+			entry->_expiry = _now_tick + period_ticks - (_now_tick - entry->_expiry) % period_ticks;
+		}
+
+		file(entry.get());
+		entry->_self = entry;
+	}
+
+	// Puts a timer in the slot its expiry maps to relative to _now_tick.
+	void file(timer* entry)
+	{
+		slot* target = &_due;
+		if (entry->_expiry > _now_tick)
+		{
+			const uint64_t delta = entry->_expiry - _now_tick;
+			int level = 0;
+			while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+				++level;
+			}
+
+			// Beyond the wheel's range: park in the furthest top-level slot
+			// and re-file when it cascades.
+			const uint64_t horizon = _now_tick + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+			const uint64_t expiry = std::min(entry->_expiry, horizon);
+			target = &_levels[level][(expiry >> (SLOT_BITS * level)) & SLOT_MASK];
+		}
+
+		entry->_slot = target;
+		entry->_previous = nullptr;
+		entry->_next = *target;
+		if (*target) {
+			(*target)->_previous = entry;
+		}
+		*target = entry;
+
+		entry->_scheduled = true;
+		++_pending;
+	}
+
+	void unlink(timer* entry)
+	{
+		if (entry->_previous) {
+			entry->_previous->_next = entry->_next;
+		}
+		else {
+			*entry->_slot = entry->_next;
+		}
+
+		if (entry->_next) {
+			entry->_next->_previous = entry->_previous;
+		}
+
+		entry->_previous = nullptr;
+		entry->_next = nullptr;
+		entry->_scheduled = false;
+		--_pending;
+	}
+
+	// At the start of each lap of a level, the next slot of the level above
+	// is redistributed over the levels below it.
+	void cascade()
+	{
+		for (int level = 1; level < LEVELS; ++level)
+		{
+			const uint64_t shift = SLOT_BITS * level;
+			if ((_now_tick & ((uint64_t(1) << shift) - 1)) != 0) {
+				break;
+			}
+
+			slot entries = std::exchange(_levels[level][(_now_tick >> shift) & SLOT_MASK], nullptr);
+			while (entries)
+			{
+				timer* entry = entries;
+				entries = entry->_next;
+				--_pending;
+				file(entry);
+			}
+		}
+	}
+
+	void take(slot* from, std::vector<std::shared_ptr<timer>>* due)
+	{
+		for (timer* entry = std::exchange(*from, nullptr); entry;)
+		{
+			timer* next = entry->_next;
+			entry->_previous = nullptr;
+			entry->_next = nullptr;
+			entry->_scheduled = false;
+			--_pending;
+			due->push_back(std::move(entry->_self));
+			entry = next;
+		}
+	}
+
+	static void release(slot& head)
+	{
+		for (timer* entry = std::exchange(head, nullptr); entry;)
+		{
+			timer* next = entry->_next;
+			entry->_scheduled = false;
+			entry->_self.reset();
+			entry = next;
+		}
+	}
+
+	static uint64_t ticks_rounded_up(clock::duration duration)
+	{
+		const auto ticks = (duration + TICK - clock::duration(1)) / TICK;
+		return ticks > 0 ? static_cast<uint64_t>(ticks) : 0;
+	}
+
+	// A timer never fires early, so deadlines round up to the next tick...
+	uint64_t tick_at_or_after(clock::time_point when) const
+	{
+		return when <= _start ? 0 : ticks_rounded_up(when - _start);
+	}
+
+	// ...and the wheel only advances over ticks that have fully passed.
+	uint64_t ticks_elapsed(clock::time_point now) const
+	{
+		return now <= _start ? 0 : static_cast<uint64_t>((now - _start) / TICK);
+	}
+
+	static constexpr int LEVELS = 4;
+	static constexpr int SLOT_BITS = 8;
+	static constexpr uint64_t SLOT_MASK = (uint64_t(1) << SLOT_BITS) - 1;
+	static constexpr clock::duration TICK = std::chrono::milliseconds(1);
+
+	const clock::time_point _start;
+	mutable std::mutex _mutex;
+	std::array<std::array<slot, size_t(1) << SLOT_BITS>, LEVELS> _levels{};
+	slot _due = nullptr;
+	uint64_t _now_tick = 0;
+	size_t _pending = 0;
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+// Define FOOBAR_TRACING to have thread_pool and concurrent_skiplist record
+// spans for task execution, steals, inserts and removes. Without it the
+// TRACE_* macros compile to nothing and the recorder below is left out, so
+// tsc_clock is not included and its startup calibration is not paid.
+#if defined(FOOBAR_TRACING)
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SPAN(category, name) trace_span TRACE_CONCAT(trace_span_, __LINE__)(category, name)
+#define TRACE_INSTANT(category, name) trace_recorder::instance().record_instant(category, name)
+#else
+#define TRACE_SPAN(category, name) ((void)0)
+#define TRACE_INSTANT(category, name) ((void)0)
+#endif
+
+#if defined(FOOBAR_TRACING)
+
+#include "tsc_clock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct trace_event
+{
+	const char* category;
+	const char* name;
+	uint64_t begin_nanoseconds;
+	// INSTANT marks an event without duration.
+	uint64_t duration_nanoseconds;
+	uint32_t thread_id;
+
+	static constexpr uint64_t INSTANT = UINT64_MAX;
+};
+
+// Collects trace events from every thread. Each thread appends to its own
+// fixed-size ring buffer without locks; when a ring is full the oldest events
+// are overwritten. collect() drains all rings and can run while threads keep
+// recording. Category and name must be string literals or otherwise outlive
+// the recorder.
+class trace_recorder
+{
+	class thread_buffer
+	{
+		// Fields are relaxed atomics so that a collector copying a slot while
+		// the owner overwrites it reads stale data rather than racing.
+		struct slot
+		{
+			std::atomic<const char*> category;
+			std::atomic<const char*> name;
+			std::atomic<uint64_t> begin_nanoseconds;
+			std::atomic<uint64_t> duration_nanoseconds;
+		};
+
+	public:
+		explicit thread_buffer(uint32_t thread_id)
+			: _slots(std::make_unique<slot[]>(CAPACITY))
+			, _thread_id(thread_id)
+		{
+		}
+
+		void push(const char* category, const char* name, uint64_t begin, uint64_t duration)
+		{
+			const auto position = _written.load(std::memory_order_relaxed);
+			auto& slot = _slots[position & (CAPACITY - 1)];
+
+			// Pairs with the acquire fence in collect: a collector that reads
+			// any of the stores below also sees _written at least at position,
+			// and so drops this slot as torn.
+			std::atomic_thread_fence(std::memory_order_release);
+			slot.category.store(category, std::memory_order_relaxed);
+			slot.name.store(name, std::memory_order_relaxed);
+			slot.begin_nanoseconds.store(begin, std::memory_order_relaxed);
+			slot.duration_nanoseconds.store(duration, std::memory_order_relaxed);
+			_written.store(position + 1, std::memory_order_release);
+		}
+
+		// Appends the events written since the previous call. Only one thread
+		// may collect from a buffer at a time.
+		void collect(std::vector<trace_event>* out)
+		{
+			const auto written = _written.load(std::memory_order_acquire);
+			const auto begin = std::max(_read, written > CAPACITY ? written - CAPACITY : 0);
+			const auto first_new = out->size();
+
+			for (auto position = begin; position < written; ++position)
+			{
+				const auto& slot = _slots[position & (CAPACITY - 1)];
+				out->push_back({
+					slot.category.load(std::memory_order_relaxed),
+					slot.name.load(std::memory_order_relaxed),
+					slot.begin_nanoseconds.load(std::memory_order_relaxed),
+					slot.duration_nanoseconds.load(std::memory_order_relaxed),
+					_thread_id });
+			}
+
+			// Slots the owner has wrapped around onto while we were copying,
+			// including the one it may be writing right now, are torn; drop
+			// them.
+			std::atomic_thread_fence(std::memory_order_acquire);
+			const auto overwritten = _written.load(std::memory_order_relaxed) + 1;
+			if (overwritten > CAPACITY && overwritten - CAPACITY > begin)
+			{
+				const auto torn = std::min(overwritten - CAPACITY, written) - begin;
+				out->erase(out->begin() + first_new, out->begin() + first_new + torn);
+			}
+
+			_read = written;
+		}
+
+		uint32_t thread_id() const
+		{
+			return _thread_id;
+		}
+
+	private:
+		std::unique_ptr<slot[]> _slots;
+		std::atomic<uint64_t> _written{ 0 };
+		uint64_t _read = 0;
+		const uint32_t _thread_id;
+
+		static constexpr uint64_t CAPACITY = 1 << 14;
+	};
+
+public:
+	static trace_recorder& instance()
+	{
+		static trace_recorder s_instance;
+		return s_instance;
+	}
+
+	void record_span(const char* category, const char* name, uint64_t begin, uint64_t duration)
+	{
+		local_buffer().push(category, name, begin, duration);
+	}
+
+	void record_instant(const char* category, const char* name)
+	{
+		local_buffer().push(category, name, now_nanoseconds(), trace_event::INSTANT);
+	}
+
+	// Returns every event recorded since the previous collect, grouped by
+	// thread and in recording order within a thread.
+	std::vector<trace_event> collect()
+	{
+		std::vector<trace_event> events;
+
+		std::scoped_lock<std::mutex> lock(_buffers_mutex);
+		for (auto it = _buffers.begin(); it != _buffers.end();)
+		{
+			(*it)->collect(&events);
+
+			// Once its thread has exited and it is drained, nobody else can
+			// reach the buffer.
+			if (it->use_count() == 1) {
+				it = _buffers.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+
+		return events;
+	}
+
+	// Drains all buffers into the Chrome trace_event JSON format, which both
+	// chrome://tracing and the Perfetto UI open directly.
+	void write_chrome_trace(std::ostream& out)
+	{
+		const auto events = collect();
+
+		out << "{\"traceEvents\":[";
+		const char* separator = "\n";
+		for (const auto& event : events)
+		{
+			out << separator << "{\"cat\":";
+			write_json_string(out, event.category);
+			out << ",\"name\":";
+			write_json_string(out, event.name);
+			out << ",\"pid\":1,\"tid\":" << event.thread_id << ",\"ts\":";
+			write_microseconds(out, event.begin_nanoseconds);
+
+			if (event.duration_nanoseconds == trace_event::INSTANT) {
+				out << ",\"ph\":\"i\",\"s\":\"t\"}";
+			}
+			else
+			{
+				out << ",\"ph\":\"X\",\"dur\":";
+				write_microseconds(out, event.duration_nanoseconds);
+				out << "}";
+			}
+
+			separator = ",\n";
+		}
+		out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+	}
+
+	bool write_chrome_trace(const std::string& path)
+	{
+		std::ofstream file(path, std::ios::trunc);
+		write_chrome_trace(file);
+		return static_cast<bool>(file.flush());
+	}
+
+	static uint64_t now_nanoseconds()
+	{
+		return static_cast<uint64_t>(tsc_clock::now().time_since_epoch().count());
+	}
+
+private:
+	trace_recorder() = default;
+
+	thread_buffer& local_buffer()
+	{
+		thread_local std::shared_ptr<thread_buffer> t_buffer;
+		if (!t_buffer)
+		{
+			t_buffer = std::make_shared<thread_buffer>(_next_thread_id.fetch_add(1, std::memory_order_relaxed));
+
+			std::scoped_lock<std::mutex> lock(_buffers_mutex);
+			_buffers.push_back(t_buffer);
+		}
+		return *t_buffer;
+	}
+
+	static void write_json_string(std::ostream& out, const char* text)
+	{
+		out << '"';
+		for (const char* c = text ? text : ""; *c; ++c)
+		{
+			if (*c == '"' || *c == '\\') {
+				out << '\\';
+			}
+			out << *c;
+		}
+		out << '"';
+	}
+
+	static void write_microseconds(std::ostream& out, uint64_t nanoseconds)
+	{
+		const auto fraction = nanoseconds % 1000;
+		out << nanoseconds / 1000 << '.'
+			<< static_cast<char>('0' + fraction / 100)
+			<< static_cast<char>('0' + fraction / 10 % 10)
+			<< static_cast<char>('0' + fraction % 10);
+	}
+
+	std::mutex _buffers_mutex;
+	std::vector<std::shared_ptr<thread_buffer>> _buffers;
+	std::atomic<uint32_t> _next_thread_id{ 1 };
+};
+
+// Records the lifetime of the scope it is declared in as a complete event,
+// timed with the same tsc_clock that basic_stopwatch can use.
+class trace_span
+{
+public:
+	trace_span(const char* category, const char* name)
+		: _category(category)
+		, _name(name)
+		, _begin(trace_recorder::now_nanoseconds())
+	{
+	}
+
+	trace_span(const trace_span&) = delete;
+	trace_span& operator=(const trace_span&) = delete;
+
+	~trace_span()
+	{
+		trace_recorder::instance().record_span(_category, _name, _begin, trace_recorder::now_nanoseconds() - _begin);
+	}
+
+private:
+	const char* _category;
+	const char* _name;
+	const uint64_t _begin;
+};
+
+#endif
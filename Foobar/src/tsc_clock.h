@@ -0,0 +1,159 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#define TSC_CLOCK_X86 1
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TSC_CLOCK_X86 1
+#else
+#define TSC_CLOCK_X86 0
+#endif
+
+// A steady clock that reads the CPU time-stamp counter, which costs a few
+// cycles instead of a trip through the OS clock. Ticks are converted to
+// nanoseconds with a scale measured against steady_clock once at startup.
+// On CPUs whose TSC is not invariant (it may stop or change rate with power
+// states) or that are not x86-64, now() uses steady_clock instead.
+class tsc_clock
+{
+public:
+	using duration = std::chrono::nanoseconds;
+	using rep = duration::rep;
+	using period = duration::period;
+	using time_point = std::chrono::time_point<tsc_clock>;
+
+	static constexpr bool is_steady = true;
+
+	static time_point now() noexcept
+	{
+		const auto& calibration = get_calibration();
+		if (!calibration.invariant)
+		{
+			const auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+			return time_point(std::chrono::duration_cast<duration>(since_epoch));
+		}
+
+		return time_point(duration(static_cast<rep>(to_nanoseconds(read_counter(), calibration.multiplier))));
+	}
+
+	static bool is_invariant()
+	{
+		return get_calibration().invariant;
+	}
+
+private:
+	struct calibration
+	{
+		bool invariant;
+		// Nanoseconds per tick as a 32.32 fixed-point number.
+		uint64_t multiplier;
+	};
+
+	static const calibration& get_calibration() noexcept
+	{
+		static const calibration s_calibration = calibrate();
+		return s_calibration;
+	}
+
+	static calibration calibrate() noexcept
+	{
+		if (!has_invariant_counter()) {
+			return { false, 0 };
+		}
+
+		// Each end of the period is a pair of clock reads that can be tens of
+		// nanoseconds apart; over a 10 ms spin that is an error of a few
+		// parts per million in the scale.
+		const auto steady_begin = std::chrono::steady_clock::now();
+		const auto ticks_begin = read_counter();
+
+		auto steady_end = steady_begin;
+		while (steady_end - steady_begin < CALIBRATION_PERIOD) {
+			steady_end = std::chrono::steady_clock::now();
+		}
+
+		const auto ticks = read_counter() - ticks_begin;
+		const auto nanoseconds = std::chrono::duration_cast<duration>(steady_end - steady_begin).count();
+		if (ticks == 0) {
+			return { false, 0 };
+		}
+
+		return { true, (static_cast<uint64_t>(nanoseconds) << 32) / ticks };
+	}
+
+	static bool has_invariant_counter() noexcept
+	{
+#if TSC_CLOCK_X86
+		unsigned int registers[4] = {};
+		cpuid(0x80000000, registers);
+		if (registers[0] < 0x80000007) {
+			return false;
+		}
+
+		cpuid(0x80000001, registers);
+		const bool has_rdtscp = (registers[3] >> 27) & 1;
+
+		cpuid(0x80000007, registers);
+		const bool invariant = (registers[3] >> 8) & 1;
+
+		return has_rdtscp && invariant;
+#else
+		return false;
+#endif
+	}
+
+	static uint64_t read_counter() noexcept
+	{
+#if TSC_CLOCK_X86
+		// rdtscp waits for earlier instructions to finish, so the timed code
+		// cannot leak past the end timestamp.
+		unsigned int processor;
+		return __rdtscp(&processor);
+#else
+		return 0;
+#endif
+	}
+
+#if TSC_CLOCK_X86
+	static void cpuid(unsigned int leaf, unsigned int (&registers)[4]) noexcept
+	{
+#if defined(_MSC_VER)
+		int values[4];
+		__cpuid(values, static_cast<int>(leaf));
+		for (int i = 0; i < 4; ++i) {
+			registers[i] = static_cast<unsigned int>(values[i]);
+		}
+#else
+		__cpuid(leaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+	}
+#endif
+
+	static uint64_t to_nanoseconds(uint64_t ticks, uint64_t multiplier) noexcept
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		uint64_t high;
+		const uint64_t low = _umul128(ticks, multiplier, &high);
+		return (high << 32) | (low >> 32);
+#elif defined(__SIZEOF_INT128__)
+		return static_cast<uint64_t>((static_cast<unsigned __int128>(ticks) * multiplier) >> 32);
+#else
+		return 0;
+#endif
+	}
+
+	static constexpr std::chrono::milliseconds CALIBRATION_PERIOD{ 10 };
+
+	// Calibrate during static initialisation rather than on the first
+	// timestamp, so no measurement absorbs the calibration delay. Every
+	// program that includes this header pays that delay at startup, so
+	// headers that only use the clock optionally include it conditionally.
+	static inline const bool s_calibrated_at_startup = (get_calibration(), true);
+};
+
+#undef TSC_CLOCK_X86